@@ -4,14 +4,40 @@
  * Autore: Giulio Triggiani
 */
 
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "mpi.h"
 
 #define DEMO 0      // Permette di mostrare la correttezza con una matrice fissata (0: non usare la demo, 1: usa la demo)
+#define VERIFY 0    // Verifica dello stato ad ogni iterazione (0: disattivata, 1: registra la traccia di riferimento, 2: confronta con la traccia di riferimento)
+#define VERIFY_TRACE "golden_trace.txt"    // File che contiene la traccia di riferimento
+#define FUSED_KERNEL 1                      // Calcolo della soddisfazione e delle celle vuote in un'unica passata sulla sottomatrice (0: due passate separate, 1: passata unica, 2: passata unica a blocchi)
+#define TILE_ROWS 16                        // Righe di un blocco della sottomatrice (FUSED_KERNEL 2)
+#define TILE_COLUMNS 512                    // Colonne di un blocco della sottomatrice (FUSED_KERNEL 2)
+#define HIERARCHICAL 0                      // Assegnazione delle celle vuote a due livelli (0: tutti i processi alla pari, 1: prima tra i nodi e poi tra i processi del nodo)
+#define COMPRESS 1                          // Compressione dei messaggi con celle vuote e agenti da spostare (0: disattivata, 1: attiva per i messaggi più grandi di COMPRESS_THRESHOLD)
+#define COMPRESS_THRESHOLD 4096             // Dimensione (in byte) oltre la quale un messaggio viene compresso
+#define MIGRATION 0                         // Scambio degli agenti tra i processi (0: messaggi punto a punto, 1: MPI_Alltoallv collettiva)
+#define PIPELINE 0                          // Sovrapposizione degli arrivi di un passo con il passo successivo (0: passi sincroni, 1: le celle che non dipendono dagli arrivi vengono calcolate mentre sono in volo)
+#define AUTOTUNE 0                          // Scelta automatica di FUSED_KERNEL, COMPRESS, MIGRATION e PIPELINE (0: usa le costanti, 1: usa il profilo salvato o calibra se manca, 2: calibra sempre)
+#define AUTOTUNE_HIERARCHICAL 0             // Scelta automatica anche di HIERARCHICAL, che cambia il risultato (0: resta quello della costante, 1: vengono provati entrambi)
+#define AUTOTUNE_STEPS 5                    // Passi di calibrazione per ogni configurazione candidata
+#define AUTOTUNE_PROFILE "autotune_profile.txt"    // File con le configurazioni scelte (per grandezza della matrice, numero di processi e di nodi)
+#define METRICS 0                           // Serie temporale delle osservabili ad ogni passo (0: disattivata, 1: file CSV, 2: file NDJSON, 3: NDJSON su socket UNIX)
+#define METRICS_OUTPUT (METRICS == 3 ? "metrics.sock" : METRICS == 2 ? "metrics.ndjson" : "metrics.csv")    // File (o socket UNIX) su cui il MASTER scrive le osservabili
+#define LARGE_GRID 0                        // Indici globali delle celle a 64 bit per matrici con più di 2^31 celle (0: indici a 32 bit, 1: indici a 64 bit)
+#define RASTER 0                            // Matrice iniziale letta da un raster binario (0: matrice generata, 1: ogni processo legge le proprie righe da RASTER_INPUT)
+#define RASTER_INPUT "grid.raster"          // File raster con la matrice iniziale (intestazione e celle da 1 o 2 bit)
+#define RASTER_MAGIC "SCHL"                 // Primi 4 byte dell'intestazione del raster
+#define RASTER_HEADER_SIZE 16               // Byte dell'intestazione: magic, righe, colonne e bit per cella (interi a 32 bit little endian)
 
 /*** Impostazione per la matrice di agenti ***/
 #define ROWS 10                       // Numero di righe della matrice
@@ -28,44 +54,158 @@
 /*** Altre impostazioni per la matrice ***/
 #define MASTER 0                                          // Rank del processo master
 #define SEED 15                                           // Seme per l'assegnazione delle celle libere
+#define DEFERRED_CELL 2                                   // Cella da calcolare dopo gli arrivi degli agenti (PIPELINE)
+#define PIPELINE_TAG 101                                  // Tag dei messaggi con gli agenti in arrivo (PIPELINE)
+#define CELLS_TAG 102                                     // Tag dei blocchi di celle scambiati punto a punto (LARGE_GRID)
 #define BLUE(string) "\033[1;34m" string "\x1b[0m"        // Colora di blu
 #define RED(string) "\033[1;31m" string "\x1b[0m"         // Colora di rosso
 /*** Fine delle impostazioni ***/
 
+/*** Tipi per gli indici delle celle ***/
+#if LARGE_GRID
+typedef long long cellIndex;                  // Indice lineare globale di una cella (riga * COLUMNS + colonna)
+typedef unsigned long long packedAgent;       // Indice locale della cella di destinazione e tipo dell'agente in una sola parola
+#define MPI_CELL_INDEX MPI_LONG_LONG
+#define MPI_PACKED_AGENT MPI_UNSIGNED_LONG_LONG
+#else
+typedef int cellIndex;
+typedef unsigned int packedAgent;
+#define MPI_CELL_INDEX MPI_INT
+#define MPI_PACKED_AGENT MPI_UNSIGNED
+#endif
+
+#define PACK_AGENT(index, agent) (((packedAgent)(index) << 1) | ((agent) == AGENT_X))    // Il bit meno significativo indica il tipo dell'agente (1: 'X', 0: 'O')
+#define AGENT_INDEX(packed) ((cellIndex)((packed) >> 1))                                  // Indice locale della cella di destinazione
+#define AGENT_TYPE(packed) (((packed) & 1) ? AGENT_X : AGENT_O)                          // Tipo dell'agente
+#define MAX_ENCODED_SIZE(count) ((size_t)(count) * 10 + ((size_t)(count) + 7) / 8)       // Dimensione massima (in byte) di count elementi compressi (varint a 64 bit e bitmap dei tipi)
+#define ENCODABLE(count) (MAX_ENCODED_SIZE(count) <= INT_MAX)                            // I byte compressi di count elementi stanno in un conteggio int di MPI
+/*** Fine dei tipi per gli indici ***/
+
 /*** Strutture per gestire la matrice ***/
 typedef struct voidCell {
-    int row_index;
-    int column_index;
+    cellIndex cell_index;    // Indice lineare globale della cella vuota
 } voidCell;
 
-typedef struct moveAgent {
-    int destination_row;
-    int destination_column;
-    char agent;
-} moveAgent;
+typedef packedAgent moveAgent;    // Agente da spostare, codificato con PACK_AGENT (l'indice è locale alla sottomatrice del destinatario)
+
+typedef struct nodeInfo {
+    MPI_Comm node_comm;        // Processi che condividono lo stesso nodo
+    MPI_Comm leader_comm;      // Leader dei nodi (MPI_COMM_NULL per chi non è leader)
+    int node_rank;             // Rank del processo nel nodo (0: leader)
+    int node_size;             // Numero di processi nel nodo
+    int node_id;               // Indice del nodo (rank del leader tra i leader)
+    int number_of_nodes;       // Numero di nodi
+    int *world_to_node;        // Rank nel nodo di ogni processo (MPI_UNDEFINED se si trova su un altro nodo)
+} nodeInfo;
+
+typedef struct engineConfig {
+    int fused_kernel;    // Come FUSED_KERNEL
+    int hierarchical;    // Come HIERARCHICAL
+    int compress;        // Come COMPRESS
+    int migration;       // Come MIGRATION
+    int pipelined;       // Come PIPELINE
+} engineConfig;
+
+typedef struct stepResult {
+    int unsatisfied_agents;            // Numero di agenti insoddisfatti del processo
+    int moved_agents;                  // Numero di agenti spostati dal processo
+    int number_of_local_void_cells;    // Numero di celle vuote nella sottomatrice
+    long long similar_neighbours[2];   // Somma dei vicini simili degli agenti 'O' e 'X' del processo
+    double phase_time[4];              // Tempo delle fasi: scambio delle righe, soddisfazione e celle vuote, assegnazione delle celle vuote, spostamento
+    unsigned long long previous_hash;  // Hash della sottomatrice alla fine del passo precedente, appena completati gli arrivi (PIPELINE con VERIFY)
+} stepResult;
+
+typedef struct pipelineState {
+    cellIndex *displacements;          // Indice globale della prima cella di ogni processo
+    cellIndex *sendcounts;             // Numero di celle di ogni processo
+    MPI_Datatype move_agent_type;      // Tipo degli agenti in arrivo
+    int *arrivals_from;                // Massimo numero di agenti in arrivo dal processo i-esimo (celle vuote del processo assegnate a lui)
+    int *departures_to;                // Celle assegnate al processo che appartengono al processo i-esimo (gli viene mandato un messaggio, anche vuoto)
+    cellIndex *pending;                // Indici locali delle celle che possono ricevere un agente da un altro processo
+    int number_of_pending;             // Numero di celle in pending
+    signed char *mask;                 // Stato delle celle della sottomatrice, riusato ad ogni passo (DEFERRED_CELL per quelle rimandate)
+    int *deferred_cells;               // Indici locali delle celle rimandate, in ordine, trovati dalla prima passata
+    int number_of_deferred;            // Numero di celle in deferred_cells
+    int deferred_capacity;             // Spazio di deferred_cells
+    moveAgent *arrivals;               // Agenti in arrivo, divisi per processo nell'ordine dei rank
+    moveAgent **departures;            // Agenti inviati, da liberare quando gli invii terminano
+    MPI_Request *requests;             // Ricezioni (prime world_size) e invii (ultime world_size) in volo
+    int in_flight;                     // Ci sono arrivi non ancora completati (1: sì, 0: no)
+} pipelineState;
+
+typedef struct verifyTrace {
+    FILE *file;                            // File della traccia (solo per il MASTER in registrazione)
+    int steps;                             // Numero di passi presenti nella traccia di riferimento
+    int per_rank;                          // 1: la traccia contiene l'hash di ogni rank (stesso numero di processi)
+    int diverged_step;                     // Primo passo in cui lo stato diverge (-1: nessuna divergenza)
+    unsigned long long *expected;          // Valori globali attesi per ogni passo (hash, agenti insoddisfatti, agenti spostati)
+    unsigned long long *expected_local;    // Hash attesi della sottomatrice del processo per ogni passo
+} verifyTrace;
 /*** Fine delle strutture ***/
 
 /*** Firme delle funzioni ***/
 int generate_matrix(char *, int, int);                                                   // Funzione per generare ed inizializzare la matrice
-int subdivide_matrix(int, int *, int *, int *);                                          // Funzione per suddividere la matrice tra i processi
+int subdivide_matrix(int, cellIndex *, cellIndex *, int *);                              // Funzione per suddividere la matrice tra i processi
 void exchange_rows(int, int, int, char *, MPI_Comm);                                     // Funzione per scambiare le righe di ogni processo con i propri vicini
-int *calculate_move(int, int, int, int, char *, int *);                                  // Funzione per calcolare gli agenti da spostare
-int is_satisfied(int, int, int, int, int, int, char *);                                  // Funzione per controllare se un agente è soddisfatto (1: soddisfatto; 0: non soddisfatto)
-voidCell *calculate_local_void_cells(int, char *, int, int *);                           // Funzione per calcolare le celle vuote locali ad un processo
-voidCell *assign_void_cells(int, int, int, voidCell *, int *, MPI_Datatype, int);        // Funzione per unire tutte le celle vuote dei processi e restituire quelle di destinazione per il processo i-esimo
-void move(int, int, int, char *, int *, voidCell *, int, int *, int *, MPI_Datatype);    // Funzione per spostare gli agenti
+signed char *calculate_move(int, int, int, int, char *, int *, long long *);             // Funzione per calcolare gli agenti da spostare
+int is_satisfied(int, int, int, int, cellIndex, int, char *, int *);                     // Funzione per controllare se un agente è soddisfatto (1: soddisfatto; 0: non soddisfatto)
+voidCell *calculate_local_void_cells(int, char *, cellIndex, int *);                     // Funzione per calcolare le celle vuote locali ad un processo
+signed char *calculate_move_and_void_cells(int, int, int, int, char *, cellIndex, int *, long long *, voidCell **, int *);    // Funzione per calcolare in un'unica passata gli agenti da spostare e le celle vuote
+signed char *calculate_move_and_void_cells_tiled(int, int, int, int, char *, cellIndex, int *, long long *, voidCell **, int *);    // Funzione per calcolare la passata unica a blocchi (con le righe e colonne di bordo copiate nel blocco)
+int classify_cell(char *, char *, char *, int, long long *);                             // Funzione per classificare una cella dalla sua finestra 3x3 (-1: vuota, 0: soddisfatto, 1: insoddisfatto)
+voidCell *assign_void_cells(int, int, int, voidCell *, int *, MPI_Datatype, int, int, pipelineState *);    // Funzione per unire tutte le celle vuote dei processi e restituire quelle di destinazione per il processo i-esimo
+voidCell *assign_void_cells_hierarchical(nodeInfo *, int, voidCell *, int *, MPI_Datatype, int, int);    // Funzione per assegnare le celle vuote prima tra i nodi e poi tra i processi di ogni nodo
+int move(int, int, int, char *, signed char *, voidCell *, int, cellIndex *, MPI_Datatype, nodeInfo *, engineConfig *, pipelineState *);    // Funzione per spostare gli agenti (restituisce il numero di agenti spostati)
 void calculate_total_satisfaction(int, int, char *);                                     // Funzione per calcolare la soddisfazione finale di tutti gli agenti della matrice
+void simulation_step(int, int, int, int, char *, cellIndex *, MPI_Datatype, MPI_Datatype, nodeInfo *, engineConfig *, pipelineState *, stepResult *);    // Funzione per eseguire un passo della simulazione
+void autotune(int, int, int, int, char *, cellIndex *, MPI_Datatype, MPI_Datatype, nodeInfo *, engineConfig *, pipelineState *);                    // Funzione per scegliere la configurazione più veloce
+
+unsigned long long splitmix64(unsigned long long);                                       // Funzione per mescolare i bit di una chiave a 64 bit
+unsigned long long hash_sub_matrix(int, char *, cellIndex);                              // Funzione per calcolare l'hash della sottomatrice usando gli indici globali
+int verify_init(int, int, verifyTrace *);                                                // Funzione per preparare la registrazione o il confronto della traccia
+void verify_step(int, int, int, unsigned long long, int, int, verifyTrace *);            // Funzione per registrare o confrontare lo stato di un passo
+int verify_moves(int, int, int, stepResult *);                                           // Funzione per controllare che ogni processo sposti quanto con l'assegnazione alla pari (1: sì, 0: no)
+void verify_finish(int, verifyTrace *);                                                  // Funzione per chiudere la verifica e mostrarne l'esito
+FILE *metrics_init(int);                                                                 // Funzione per aprire il file (o il socket) delle osservabili
+void metrics_step(int, int, long long *, double, FILE **);                               // Funzione per ridurre e scrivere le osservabili di un passo
 
 void define_voidCell_type(MPI_Datatype *);                                               // Funzione per definire il tipo voidCell
 void define_moveAgent_type(MPI_Datatype *);                                              // Funzione per definire il tipo moveAgent
-int calculate_source(int, int *, int *, int);                                            // Funzione per calcolare a quale processo appartiene una determinata riga della matrice
-void synchronize(int, int, int *, int, moveAgent **, int, char *, MPI_Datatype);         // Funzione per sincronizzare gli spostamenti tra i processi
+int calculate_source(int, cellIndex *, cellIndex);                                       // Funzione per calcolare a quale processo appartiene una determinata cella della matrice
+void synchronize(int, int, int *, int, moveAgent **, int, char *, MPI_Datatype, nodeInfo *, int);    // Funzione per sincronizzare gli spostamenti tra i processi
+void synchronize_collective(int, int *, moveAgent **, char *, MPI_Datatype);             // Funzione per sincronizzare gli spostamenti tra i processi con una comunicazione collettiva
+void define_node_info(int, int, nodeInfo *);                                             // Funzione per raggruppare i processi per nodo e scegliere i leader
+void free_node_info(nodeInfo *);                                                         // Funzione per liberare i comunicatori dei nodi
+void split_void_cells(cellIndex, int, cellIndex *, cellIndex *, cellIndex *);            // Funzione per calcolare quante celle vuote spettano ad ogni processo (o nodo)
+cellIndex split_shares(cellIndex, cellIndex, int, cellIndex *, cellIndex *, cellIndex *); // Funzione per dividere le celle vuote data la quota di ogni processo e le celle in più (restituisce quelle in più non usate)
+cellIndex random_index(cellIndex);                                                       // Funzione per estrarre un indice casuale tra 0 e n - 1 (anche oltre RAND_MAX)
+void allgatherv_cells(void *, int *, cellIndex *, MPI_Datatype, MPI_Comm);               // Come MPI_Allgatherv (sul posto) ma con displacements a 64 bit
+void gatherv_cells(void *, int, void *, int *, cellIndex *, MPI_Datatype, int, MPI_Comm);    // Come MPI_Gatherv ma con displacements a 64 bit
+void scatterv_cells(void *, int *, cellIndex *, void *, int, MPI_Datatype, int, MPI_Comm);   // Come MPI_Scatterv ma con displacements a 64 bit
+void alltoallv_cells(void *, int *, cellIndex *, void *, int *, cellIndex *, MPI_Datatype, MPI_Comm);    // Come MPI_Alltoallv ma con displacements a 64 bit
+void pipeline_init(int, cellIndex *, cellIndex *, MPI_Datatype, pipelineState *);        // Funzione per preparare lo stato degli arrivi in volo (PIPELINE)
+void pipeline_free(pipelineState *);                                                     // Funzione per liberare lo stato degli arrivi in volo
+signed char *defer_pending_cells(int, int, int, pipelineState *);                        // Funzione per segnare le celle che dipendono dagli arrivi o dalle righe dei vicini
+void calculate_pipelined_cells(int, int, int, int, char *, cellIndex, pipelineState *, int, int *, long long *, voidCell *, int *);    // Funzione per calcolare le celle pronte (o quelle rimandate) come calculate_move_and_void_cells
+void merge_void_cells(voidCell *, int, voidCell *, int);                                 // Funzione per unire due array ordinati di celle vuote nel primo
+void pipeline_post(int, int, int *, moveAgent **, pipelineState *);                      // Funzione per inviare gli agenti senza aspettarne l'arrivo
+void pipeline_complete(int, char *, pipelineState *);                                    // Funzione per completare gli arrivi in volo e scriverli nella sottomatrice
+int encode_void_cells(voidCell *, int, unsigned char *);                                 // Funzione per comprimere un array di celle vuote (restituisce i byte scritti)
+void decode_void_cells(unsigned char *, int, voidCell *);                                // Funzione per decomprimere un array di celle vuote
+int encode_moved_agents(moveAgent *, int, unsigned char *);                              // Funzione per ordinare e comprimere un array di agenti da spostare (restituisce i byte scritti)
+void decode_moved_agents(unsigned char *, int, moveAgent *);                             // Funzione per decomprimere un array di agenti da spostare
+int compare_void_cells(const void *, const void *);                                      // Funzione per ordinare le celle vuote (qsort)
+int compare_moved_agents(const void *, const void *);                                    // Funzione per ordinare gli agenti da spostare (qsort)
 void print_matrix(int, int, char *);                                                     // Funzione per stampare la matrice
-void err_finish(int *, int *, int *);                                                    // Funzione per terminare l'esecuzione in caso di errori
+void err_finish(cellIndex *, cellIndex *, int *);                                        // Funzione per terminare l'esecuzione in caso di errori
 
 // DEMO
 void test_init_matrix(char *matrix, int O_pct, int X_pct);
 // DEMO
+
+// RASTER
+int read_raster(int, int, int, char *);                                                  // Funzione per leggere e decodificare le righe del processo dal raster (1: letto; 0: errore)
+// RASTER
 /*** Fine delle firme ***/
 
 /*** Funzione main ***/
@@ -75,15 +215,19 @@ int main(int argc, char **argv) {
     double start_time, end_time;            // Tempo di inizio e fine computazione
     char *matrix = NULL;                    // Matrice di char ('X', 'O', ' ')
     char *sub_matrix = NULL;                // Sottomatrice assegnata ad un processo
-    int *displacements = NULL;              // Array che contiene i displacements per ogni processo (per la MPI_Scatterv)
-    int *sendcounts = NULL;                 // Array che contiene il numero di elementi (#righe_assegnate * #colonne) di un processo
+    cellIndex *displacements = NULL;        // Array che contiene l'indice globale della prima cella di ogni processo
+    cellIndex *sendcounts = NULL;           // Array che contiene il numero di elementi (#righe_assegnate * #colonne) di un processo
+    int *scatter_counts = NULL;             // Righe assegnate ad ogni processo (per la MPI_Scatterv e la MPI_Gatherv, in righe per non superare il limite degli int)
+    int *scatter_displacements = NULL;      // Riga iniziale di ogni processo (per la MPI_Scatterv e la MPI_Gatherv)
     int *rows_per_process = NULL;           // Array che contiene il numero di righe assegnate ad ogni processo
-    int *want_move = NULL;                  // Array che indica quali agenti della sottomatrice vogliono muoversi
-    int unsatisfied_agents = 0;             // Numero di agenti insoddisfatti per ogni processo (ad ogni iterazione)
-    int number_of_local_void_cells = 0;     // Numero di celle vuote nella sottomatrice
-    voidCell *local_void_cells = NULL;      // Array che contiene le celle vuote della sottomatrice
-    int number_of_destination_cells = 0;    // Numero di celle vuote che sono state assegnate al processo
-    voidCell *destinations = NULL;          // Array che contiene le celle vuote che sono state assegnate al processo dove poter spostare gli agenti
+    stepResult result;                      // Agenti insoddisfatti, spostati, celle vuote e tempi del processo (ad ogni iterazione)
+    verifyTrace trace;                      // Traccia per la verifica dello stato (VERIFY)
+    int moves_ok = 1;                       // Tutti i passi spostano quanto l'assegnazione alla pari (VERIFY)
+    FILE *metrics = NULL;                   // File (o socket) delle osservabili (METRICS, solo MASTER)
+    nodeInfo node;                          // Suddivisione dei processi per nodo (HIERARCHICAL)
+    engineConfig config = {FUSED_KERNEL, HIERARCHICAL, COMPRESS, MIGRATION, PIPELINE};    // Configurazione usata per i passi (può essere scelta da AUTOTUNE)
+    pipelineState pipeline;                 // Arrivi degli agenti ancora in volo (PIPELINE)
+    stepResult previous;                    // Risultato del passo precedente, verificato con un passo di ritardo (PIPELINE con VERIFY)
 
     // Inizializzazione MPI
     MPI_Status status;
@@ -95,8 +239,10 @@ int main(int argc, char **argv) {
 
     // Inizzilizzazione variabili
     start_time = MPI_Wtime();                                 // Ritorna il tempo passato dalla chiamata di un processo
-    sendcounts = calloc(world_size, sizeof(int));
-    displacements = calloc(world_size, sizeof(int));
+    sendcounts = calloc(world_size, sizeof(cellIndex));
+    displacements = calloc(world_size, sizeof(cellIndex));
+    scatter_counts = calloc(world_size, sizeof(int));
+    scatter_displacements = calloc(world_size, sizeof(int));
     rows_per_process = calloc(world_size, sizeof(int));
 
     // Definizione MPI_Datatype
@@ -104,15 +250,24 @@ int main(int argc, char **argv) {
     define_voidCell_type(&VOID_CELL_TYPE);
     MPI_Datatype MOVE_AGENT_TYPE;
     define_moveAgent_type(&MOVE_AGENT_TYPE);
+    MPI_Datatype ROW_TYPE;
+    MPI_Type_contiguous(COLUMNS, MPI_CHAR, &ROW_TYPE);    // Una riga della matrice
+    MPI_Type_commit(&ROW_TYPE);
+
+    // Raggruppamento dei processi per nodo
+    define_node_info(rank, world_size, &node);
 
     // Inizializzazione matrice
     if (world_size <= ROWS) {
         if (rank == MASTER) {
-            matrix = malloc(ROWS * COLUMNS * sizeof(char *));
-            if (DEMO)
-                test_init_matrix(matrix, O_PERCENTAGE, X_PERCENTAGE);
-            else if (!generate_matrix(matrix, O_PERCENTAGE, X_PERCENTAGE))
-                err_finish(sendcounts, displacements, rows_per_process);
+            // Con il raster il master non legge la matrice, ogni processo legge solo le proprie righe
+            if (!RASTER) {
+                matrix = malloc((size_t)ROWS * COLUMNS * sizeof(char));
+                if (DEMO)
+                    test_init_matrix(matrix, O_PERCENTAGE, X_PERCENTAGE);
+                else if (!generate_matrix(matrix, O_PERCENTAGE, X_PERCENTAGE))
+                    err_finish(sendcounts, displacements, rows_per_process);
+            }
 
             // Mostra informazioni
             time_t mytime;
@@ -122,8 +277,12 @@ int main(int argc, char **argv) {
             printf("Started at: %s", asctime(timeinfo));  
             printf("Number of processes: %d\n", world_size);
             printf("Number of iterations: %d\n", MAX_STEP);
-            printf("\nMatrice iniziale:\n");
-            print_matrix(ROWS, COLUMNS, matrix);
+            if (RASTER)
+                printf("\nMatrice iniziale letta da %s\n", RASTER_INPUT);
+            else {
+                printf("\nMatrice iniziale:\n");
+                print_matrix(ROWS, COLUMNS, matrix);
+            }
         }
     }
 
@@ -132,39 +291,84 @@ int main(int argc, char **argv) {
         err_finish(sendcounts, displacements, rows_per_process);
 
     // Suddivisione delle righe tra i processi
-    sub_matrix = malloc(rows_per_process[rank] * COLUMNS * sizeof(char *));
-    MPI_Scatterv(matrix, sendcounts, displacements, MPI_CHAR, sub_matrix, rows_per_process[rank] * COLUMNS, MPI_CHAR, MASTER, MPI_COMM_WORLD);    // Funzione MPI che permette di dividere il carico sui processi (sendbuf, sendcounts, displacements, sendtype, recvbuf, recvcount, recvtype, root, comm)
+    for (int i = 0; i < world_size; i++) {
+        scatter_counts[i] = sendcounts[i] / COLUMNS;
+        scatter_displacements[i] = displacements[i] / COLUMNS;
+    }
+    sub_matrix = malloc((size_t)rows_per_process[rank] * COLUMNS * sizeof(char));
+    if (RASTER) {
+        if (!read_raster(rank, scatter_displacements[rank], scatter_counts[rank], sub_matrix))
+            err_finish(sendcounts, displacements, rows_per_process);
+    } else
+        MPI_Scatterv(matrix, scatter_counts, scatter_displacements, ROW_TYPE, sub_matrix, scatter_counts[rank], ROW_TYPE, MASTER, MPI_COMM_WORLD);    // Funzione MPI che permette di dividere il carico sui processi (sendbuf, sendcounts, displacements, sendtype, recvbuf, recvcount, recvtype, root, comm)
 
     // Calcolo di quante righe 'originali' ha il processo e di quante ne ha 'totali'
     int total_rows = rows_per_process[rank];      // Righe con gia assegnate quelle in più
     int original_rows = total_rows - ((rank == 0 || rank == world_size - 1) ? 1 : 2);
 
-    // Comincia l'esecuzione (verrà eseguita un massimo di MAX_STEP volte)
-    for (int i = 0; i < MAX_STEP; i++) {
-        // Scambia le righe tra i processi vicini e calcola gli agenti che si vogliono spostare
-        exchange_rows(rank, world_size, original_rows, sub_matrix, MPI_COMM_WORLD);
-        want_move = calculate_move(rank, world_size, original_rows, total_rows, sub_matrix, &unsatisfied_agents);
+    pipeline_init(world_size, displacements, sendcounts, MOVE_AGENT_TYPE, &pipeline);
 
-        // Calcolo delle celle vuote di ogni processo e assegnazione delle celle vuote a ciascun processo
-        local_void_cells = calculate_local_void_cells(original_rows, sub_matrix, displacements[rank], &number_of_local_void_cells);
-        destinations = assign_void_cells(rank, world_size, number_of_local_void_cells, local_void_cells, &number_of_destination_cells, VOID_CELL_TYPE, unsatisfied_agents);
+    // Scelta della configurazione più veloce (la sottomatrice torna allo stato iniziale)
+    if (AUTOTUNE)
+        autotune(rank, world_size, original_rows, total_rows, sub_matrix, displacements, VOID_CELL_TYPE, MOVE_AGENT_TYPE, &node, &config, &pipeline);
 
-        // Gli agenti insoddisfatti vengono spostati
-        move(rank, world_size, original_rows, sub_matrix, want_move, destinations, number_of_destination_cells, displacements, sendcounts, MOVE_AGENT_TYPE);
+    // Apertura del file delle osservabili
+    if (METRICS)
+        metrics = metrics_init(rank);
 
-        MPI_Barrier(MPI_COMM_WORLD);
+    // Preparazione della verifica, il passo 0 rappresenta la matrice iniziale
+    if (VERIFY) {
+        if (!verify_init(rank, world_size, &trace))
+            err_finish(sendcounts, displacements, rows_per_process);
+        verify_step(rank, world_size, 0, hash_sub_matrix(original_rows, sub_matrix, displacements[rank]), 0, 0, &trace);
+    }
+
+    // Comincia l'esecuzione (verrà eseguita un massimo di MAX_STEP volte)
+    for (int i = 0; i < MAX_STEP; i++) {
+        simulation_step(rank, world_size, original_rows, total_rows, sub_matrix, displacements, VOID_CELL_TYPE, MOVE_AGENT_TYPE, &node, &config, &pipeline, &result);
+
+        // Registra o confronta lo stato raggiunto alla fine del passo (con PIPELINE il passo precedente, completato solo ora)
+        if (VERIFY && !config.pipelined)
+            verify_step(rank, world_size, i + 1, hash_sub_matrix(original_rows, sub_matrix, displacements[rank]), result.unsatisfied_agents, result.moved_agents, &trace);
+        else if (VERIFY) {
+            if (i > 0)
+                verify_step(rank, world_size, i, result.previous_hash, previous.unsatisfied_agents, previous.moved_agents, &trace);
+            previous = result;
+        }
 
-        free(want_move);
-        free(local_void_cells);
-        free(destinations);
+        // Con qualunque assegnazione ogni processo deve spostare tanti agenti quanti ne sposterebbe l'assegnazione alla pari
+        if (VERIFY && moves_ok)
+            moves_ok = verify_moves(rank, world_size, i + 1, &result);
+
+        // Osservabili del passo
+        if (METRICS) {
+            long long observables[5] = {result.unsatisfied_agents, result.moved_agents, result.number_of_local_void_cells, result.similar_neighbours[0], result.similar_neighbours[1]};
+            metrics_step(rank, i + 1, observables, MPI_Wtime() - start_time, &metrics);
+        }
     }
 
+    // Gli ultimi arrivi vengono completati prima di recuperare la matrice
+    pipeline_complete(world_size, sub_matrix, &pipeline);
+    if (VERIFY && config.pipelined)
+        verify_step(rank, world_size, MAX_STEP, hash_sub_matrix(original_rows, sub_matrix, displacements[rank]), previous.unsatisfied_agents, previous.moved_agents, &trace);
+
     // Si recupera la matrice finale
-    MPI_Gatherv(sub_matrix, sendcounts[rank], MPI_CHAR, matrix, sendcounts, displacements, MPI_CHAR, MASTER, MPI_COMM_WORLD);  // (sendbuff, sendcount, datatype, destbuff, destcount, displacements, datatype, root, comm)
+    if (RASTER && rank == MASTER)
+        matrix = malloc((size_t)ROWS * COLUMNS * sizeof(char));
+    MPI_Gatherv(sub_matrix, scatter_counts[rank], ROW_TYPE, matrix, scatter_counts, scatter_displacements, ROW_TYPE, MASTER, MPI_COMM_WORLD);  // (sendbuff, sendcount, datatype, destbuff, destcount, displacements, datatype, root, comm)
 
     end_time = MPI_Wtime();
+    if (VERIFY)
+        verify_finish(rank, &trace);
+    if (VERIFY && moves_ok && rank == MASTER)
+        printf("Assegnazione: in %d passi ogni processo ha spostato quanto con l'assegnazione alla pari\n", MAX_STEP);
+    if (metrics != NULL)
+        fclose(metrics);
     MPI_Type_free(&VOID_CELL_TYPE);
     MPI_Type_free(&MOVE_AGENT_TYPE);
+    MPI_Type_free(&ROW_TYPE);
+    free_node_info(&node);
+    pipeline_free(&pipeline);
     MPI_Finalize();
 
     // Stampa matrice finale e calcolo della soddisfazione totale
@@ -179,17 +383,204 @@ int main(int argc, char **argv) {
     free(sub_matrix);
     free(sendcounts);
     free(displacements);
+    free(scatter_counts);
+    free(scatter_displacements);
     free(rows_per_process);
 
     return 0;
 }
 /*** Fine funzione main ***/
 
+/*** Inizio funzione per eseguire un passo della simulazione ***/
+void simulation_step(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, cellIndex *displacements, MPI_Datatype void_cell_type, MPI_Datatype move_agent_type, nodeInfo *node, engineConfig *config, pipelineState *pipeline, stepResult *result) {
+    signed char *want_move = NULL;          // Array che indica quali agenti della sottomatrice vogliono muoversi
+    voidCell *local_void_cells = NULL;      // Array che contiene le celle vuote della sottomatrice
+    int number_of_destination_cells = 0;    // Numero di celle vuote che sono state assegnate al processo
+    voidCell *destinations = NULL;          // Array che contiene le celle vuote che sono state assegnate al processo dove poter spostare gli agenti
+    double time = MPI_Wtime();              // Inizio della fase corrente
+
+    if (config->pipelined) {
+        int number_of_late_void_cells = 0;  // Celle vuote trovate tra quelle rimandate
+
+        // Mentre gli agenti del passo precedente sono in volo si calcolano le celle che non possono cambiare (e si elencano quelle rimandate)
+        want_move = defer_pending_cells(rank, world_size, original_rows, pipeline);
+        local_void_cells = malloc(original_rows * COLUMNS * sizeof(voidCell));
+        result->unsatisfied_agents = result->number_of_local_void_cells = 0;
+        result->similar_neighbours[0] = result->similar_neighbours[1] = 0;
+        calculate_pipelined_cells(rank, world_size, original_rows, total_rows, sub_matrix, displacements[rank], pipeline, 0, &result->unsatisfied_agents, result->similar_neighbours, local_void_cells, &result->number_of_local_void_cells);
+        voidCell *late_void_cells = malloc(pipeline->number_of_deferred * sizeof(voidCell));
+        result->phase_time[1] = MPI_Wtime() - time;
+        time += result->phase_time[1];
+
+        // Arrivi e scambio delle righe tra i processi vicini
+        pipeline_complete(world_size, sub_matrix, pipeline);
+        if (VERIFY)
+            result->previous_hash = hash_sub_matrix(original_rows, sub_matrix, displacements[rank]);
+        exchange_rows(rank, world_size, original_rows, sub_matrix, MPI_COMM_WORLD);
+        result->phase_time[0] = MPI_Wtime() - time;
+        time += result->phase_time[0];
+
+        // Le celle rimandate, poi le celle vuote tornano nello stesso ordine della passata unica
+        calculate_pipelined_cells(rank, world_size, original_rows, total_rows, sub_matrix, displacements[rank], pipeline, 1, &result->unsatisfied_agents, result->similar_neighbours, late_void_cells, &number_of_late_void_cells);
+        merge_void_cells(local_void_cells, result->number_of_local_void_cells, late_void_cells, number_of_late_void_cells);
+        result->number_of_local_void_cells += number_of_late_void_cells;
+        local_void_cells = realloc(local_void_cells, result->number_of_local_void_cells * sizeof(voidCell));
+        free(late_void_cells);
+        result->phase_time[1] += MPI_Wtime() - time;
+        time = MPI_Wtime();
+    } else {
+        // Scambia le righe tra i processi vicini
+        exchange_rows(rank, world_size, original_rows, sub_matrix, MPI_COMM_WORLD);
+        result->phase_time[0] = MPI_Wtime() - time;
+        time += result->phase_time[0];
+
+        // Calcola gli agenti che si vogliono spostare e le celle vuote di ogni processo
+        if (config->fused_kernel == 2)
+            want_move = calculate_move_and_void_cells_tiled(rank, world_size, original_rows, total_rows, sub_matrix, displacements[rank], &result->unsatisfied_agents, result->similar_neighbours, &local_void_cells, &result->number_of_local_void_cells);
+        else if (config->fused_kernel)
+            want_move = calculate_move_and_void_cells(rank, world_size, original_rows, total_rows, sub_matrix, displacements[rank], &result->unsatisfied_agents, result->similar_neighbours, &local_void_cells, &result->number_of_local_void_cells);
+        else {
+            want_move = calculate_move(rank, world_size, original_rows, total_rows, sub_matrix, &result->unsatisfied_agents, result->similar_neighbours);
+            local_void_cells = calculate_local_void_cells(original_rows, sub_matrix, displacements[rank], &result->number_of_local_void_cells);
+        }
+        result->phase_time[1] = MPI_Wtime() - time;
+        time += result->phase_time[1];
+    }
+
+    // Assegnazione delle celle vuote a ciascun processo (con PIPELINE sempre alla pari, per sapere da chi arriveranno gli agenti)
+    if (config->hierarchical && !config->pipelined)
+        destinations = assign_void_cells_hierarchical(node, result->number_of_local_void_cells, local_void_cells, &number_of_destination_cells, void_cell_type, result->unsatisfied_agents, config->compress);
+    else
+        destinations = assign_void_cells(rank, world_size, result->number_of_local_void_cells, local_void_cells, &number_of_destination_cells, void_cell_type, result->unsatisfied_agents, config->compress, config->pipelined ? pipeline : NULL);
+    result->phase_time[2] = MPI_Wtime() - time;
+    time += result->phase_time[2];
+
+    // Gli agenti insoddisfatti vengono spostati (con PIPELINE gli arrivi vengono completati nel passo successivo, senza barriera)
+    result->moved_agents = move(rank, world_size, original_rows, sub_matrix, want_move, destinations, number_of_destination_cells, displacements, move_agent_type, config->hierarchical ? node : NULL, config, pipeline);
+
+    if (!config->pipelined)
+        MPI_Barrier(MPI_COMM_WORLD);
+    result->phase_time[3] = MPI_Wtime() - time;
+
+    if (!config->pipelined)
+        free(want_move);    // Con PIPELINE è la maschera di pipeline, riusata al passo successivo
+    free(local_void_cells);
+    free(destinations);
+}
+/*** Fine funzione per eseguire un passo della simulazione ***/
+
+/*** Inizio funzione per scegliere la configurazione più veloce ***/
+void autotune(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, cellIndex *displacements, MPI_Datatype void_cell_type, MPI_Datatype move_agent_type, nodeInfo *node, engineConfig *config, pipelineState *pipeline) {
+    int settings[6] = {0, 0, 0, 0, 0, 0};  // Profilo trovato (1: sì, 0: no) e configurazione, condivisi dal MASTER
+    size_t slab_size = (size_t)total_rows * COLUMNS * sizeof(char);
+    stepResult result;
+
+    // Il profilo è indicizzato per grandezza della matrice, numero di processi e numero di nodi (vale l'ultima riga corrispondente)
+    if (AUTOTUNE == 1 && rank == MASTER) {
+        FILE *profile = fopen(AUTOTUNE_PROFILE, "r");
+        int key[4], values[5];
+        char line[256];
+
+        // Le righe con un numero diverso di valori (scritte prima di PIPELINE) vengono ignorate, come quelle con un altro HIERARCHICAL se non viene calibrato
+        while (profile != NULL && fgets(line, sizeof(line), profile) != NULL)
+            if (sscanf(line, "%d %d %d %d %d %d %d %d %d", &key[0], &key[1], &key[2], &key[3], &values[0], &values[1], &values[2], &values[3], &values[4]) == 9 &&
+                key[0] == ROWS && key[1] == COLUMNS && key[2] == world_size && key[3] == node->number_of_nodes && (AUTOTUNE_HIERARCHICAL || values[1] == HIERARCHICAL)) {
+                settings[0] = 1;
+                memcpy(settings + 1, values, sizeof(values));
+            }
+        if (profile != NULL)
+            fclose(profile);
+    }
+    MPI_Bcast(settings, 6, MPI_INT, MASTER, MPI_COMM_WORLD);
+
+    if (settings[0]) {
+        engineConfig stored = {settings[1], settings[2], settings[3], settings[4], settings[5]};
+        *config = stored;
+        if (rank == MASTER)
+            printf("Configurazione dal profilo %s: fused %d, hierarchical %d, compress %d, migration %d, pipeline %d\n", AUTOTUNE_PROFILE, config->fused_kernel, config->hierarchical, config->compress, config->migration, config->pipelined);
+        if (rank == MASTER && config->hierarchical != HIERARCHICAL)
+            printf("\033[1;31mATTENZIONE\033[0m! Hierarchical %d invece di %d: le celle vuote vengono estratte in modo diverso e il risultato cambia.\n", config->hierarchical, HIERARCHICAL);
+        return;
+    }
+
+    // Calibrazione: ogni candidato parte dalla stessa sottomatrice iniziale ed esegue AUTOTUNE_STEPS passi reali
+    char *initial = malloc(slab_size);
+    memcpy(initial, sub_matrix, slab_size);
+
+    // Un passo iniziale non misurato, per non penalizzare il primo candidato (connessioni e cache)
+    simulation_step(rank, world_size, original_rows, total_rows, sub_matrix, displacements, void_cell_type, move_agent_type, node, config, pipeline, &result);
+    pipeline_complete(world_size, sub_matrix, pipeline);
+
+    engineConfig best = *config;
+    double best_time = -1;
+
+    if (rank == MASTER)
+        printf("\nCalibrazione (%d passi, tempi del processo più lento in secondi):\n", AUTOTUNE_STEPS);
+
+    for (int candidate = 0; candidate < 48; candidate++) {
+        engineConfig tried = {candidate % 3, (candidate / 3) & 1, (candidate / 6) & 1, (candidate / 12) & 1, (candidate / 24) & 1};
+        double times[5] = {0, 0, 0, 0, 0};    // Tempo delle quattro fasi e tempo totale del processo
+        double slowest[5];                    // Massimo tra i processi (il passo termina con una barriera)
+
+        // HIERARCHICAL cambia quali celle vuote vengono estratte: senza AUTOTUNE_HIERARCHICAL si provano solo configurazioni con lo stesso risultato
+        if (!AUTOTUNE_HIERARCHICAL && tried.hierarchical != HIERARCHICAL)
+            continue;
+
+        // La migrazione collettiva non comprime gli agenti: COMPRESS resta quello della costante (vale solo per la raccolta delle celle vuote)
+        if (tried.migration && tried.compress != COMPRESS)
+            continue;
+
+        // PIPELINE usa sempre la passata unica, l'assegnazione alla pari e i propri messaggi: le altre combinazioni sarebbero ripetute (o cambierebbero il risultato)
+        if (tried.pipelined && (tried.fused_kernel != 1 || tried.hierarchical || tried.migration))
+            continue;
+
+        memcpy(sub_matrix, initial, slab_size);
+        for (int step = 0; step < AUTOTUNE_STEPS; step++) {
+            simulation_step(rank, world_size, original_rows, total_rows, sub_matrix, displacements, void_cell_type, move_agent_type, node, &tried, pipeline, &result);
+            for (int phase = 0; phase < 4; phase++) {
+                times[phase] += result.phase_time[phase];
+                times[4] += result.phase_time[phase];
+            }
+        }
+        pipeline_complete(world_size, sub_matrix, pipeline);
+        MPI_Allreduce(times, slowest, 5, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+        if (rank == MASTER)
+            printf("- fused %d, hierarchical %d, compress %d, migration %d, pipeline %d: righe %.6f, soddisfazione %.6f, assegnazione %.6f, spostamento %.6f, totale %.6f\n",
+                   tried.fused_kernel, tried.hierarchical, tried.compress, tried.migration, tried.pipelined, slowest[0], slowest[1], slowest[2], slowest[3], slowest[4]);
+
+        // Tutti i processi vedono gli stessi tempi e scelgono la stessa configurazione
+        if (best_time < 0 || slowest[4] < best_time) {
+            best_time = slowest[4];
+            best = tried;
+        }
+    }
+
+    memcpy(sub_matrix, initial, slab_size);
+    free(initial);
+    *config = best;
+
+    // La configurazione scelta viene aggiunta al profilo
+    if (rank == MASTER) {
+        FILE *profile = fopen(AUTOTUNE_PROFILE, "a");
+
+        printf("Configurazione scelta: fused %d, hierarchical %d, compress %d, migration %d, pipeline %d\n", config->fused_kernel, config->hierarchical, config->compress, config->migration, config->pipelined);
+        if (config->hierarchical != HIERARCHICAL)
+            printf("\033[1;31mATTENZIONE\033[0m! Hierarchical %d invece di %d: le celle vuote vengono estratte in modo diverso e il risultato cambia.\n", config->hierarchical, HIERARCHICAL);
+        if (profile != NULL) {
+            fprintf(profile, "%d %d %d %d %d %d %d %d %d\n", ROWS, COLUMNS, world_size, node->number_of_nodes, config->fused_kernel, config->hierarchical, config->compress, config->migration, config->pipelined);
+            fclose(profile);
+        } else
+            printf("\033[1;31mATTENZIONE\033[0m! Impossibile scrivere il profilo %s.\n", AUTOTUNE_PROFILE);
+    }
+}
+/*** Fine funzione per scegliere la configurazione più veloce ***/
+
 /*** Inizion funzione per generare ed inizializzare la matrice ***/
 int generate_matrix(char *matrix, int O_pct, int X_pct) {
     int row, column, random;
 
-    srand(time(NULL) + MASTER);     // Genera un numero casuale
+    srand(VERIFY ? SEED : time(NULL) + MASTER);     // Genera un numero casuale (con la verifica il seme è fisso per poter confrontare le tracce)
 
     // Controllo sulla grandezza della matrice
     if (ROWS <= 0 || COLUMNS <= 0) {
@@ -208,15 +599,15 @@ int generate_matrix(char *matrix, int O_pct, int X_pct) {
             random = rand() % 100;       // Numero casuale tra 0 e 99
 
             if ((random >= 0) && (random < O_pct)) {
-                *(matrix + (row * COLUMNS) + column) = AGENT_O;
+                *(matrix + (cellIndex)row * COLUMNS + column) = AGENT_O;
             }
 
             if ((random >= O_pct) && (random < O_pct + X_pct)) {
-                *(matrix + (row * COLUMNS) + column) = AGENT_X;
+                *(matrix + (cellIndex)row * COLUMNS + column) = AGENT_X;
             }
 
             if ((random >= O_pct + X_pct) && (random < 100)) {
-                *(matrix + (row * COLUMNS) + column) = EMPTY;
+                *(matrix + (cellIndex)row * COLUMNS + column) = EMPTY;
             }
         }
     }
@@ -226,7 +617,7 @@ int generate_matrix(char *matrix, int O_pct, int X_pct) {
 /*** Fine funzione per generare ed inizializzare la matrice ***/
 
 /*** Inizio funzione per suddividere la matrice tra i processi ***/
-int subdivide_matrix(int world_size, int *displacements, int *sendcounts, int *rows_per_process) {
+int subdivide_matrix(int world_size, cellIndex *displacements, cellIndex *sendcounts, int *rows_per_process) {
     // Controllo sulla correttezza dell'input
     if (world_size <= 0 || ROWS <= 0 || COLUMNS <= 0 || displacements == NULL || sendcounts == NULL || rows_per_process == NULL) {
         printf("\033[1;31mERROR\033[0m! Invalid input in subdivide_matrix.\n\n");
@@ -235,11 +626,11 @@ int subdivide_matrix(int world_size, int *displacements, int *sendcounts, int *r
 
     int divisione = (ROWS) / (world_size);     // Numero di righe da asseganre ad ogni processo
     int resto = (ROWS) % (world_size);         // Nel caso in cui il numero di righe non sia divisibile per il nuermo di processori
-    int displacement = 0;                      // All'inizio viene settato a 0
+    cellIndex displacement = 0;                // All'inizio viene settato a 0
 
     // Assegna il giusto numero di righe ad ogni processo
     for (int i = 0; i < world_size; i++) {
-        sendcounts[i] = divisione * COLUMNS;
+        sendcounts[i] = (cellIndex)divisione * COLUMNS;
         rows_per_process[i] = divisione;
 
         if (resto > 0) {
@@ -297,19 +688,22 @@ void exchange_rows(int rank, int world_size, int original_rows, char *sub_matrix
 /*** Fine funzione per scambiare le righe dei processi vicini ***/
 
 /*** Inizio funzione per calcolare gli agenti da spostare ***/
-int *calculate_move(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, int *unsatisfied_agents) {
+signed char *calculate_move(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, int *unsatisfied_agents, long long *similar_neighbours) {
     // Alloca spazio per la matriche che conterra gli agenti che si vogliono sposare, inizialmente gli agenti insodisfatti sono 0 (ancora devono essere calcolati)
-    int *mat = (int *)malloc(original_rows * COLUMNS * sizeof(int));
+    signed char *mat = (signed char *)malloc(original_rows * COLUMNS * sizeof(signed char));
     *unsatisfied_agents = 0;
+    similar_neighbours[0] = similar_neighbours[1] = 0;
 
     // Cicla su tutta la matrice per calcolare gli agenti insodisfatti
     for (int i = 0; i < original_rows; i++) {
         for (int j = 0; j < COLUMNS; j++) {
             if (sub_matrix[i * COLUMNS + j] != EMPTY) {  // Se la cella non è vuota bisogna calcolare se lagente è sodisfatto o meno
-                int satisfied = is_satisfied(rank, world_size, original_rows, total_rows, i * COLUMNS, j, sub_matrix);
+                int similar;
+                int satisfied = is_satisfied(rank, world_size, original_rows, total_rows, i * COLUMNS, j, sub_matrix, &similar);
                 // is_satisfied = 1: non soddisfatto
                 // is_satisfied = 0: soddisfatto
                 mat[i * COLUMNS + j] = satisfied ? 0 : 1;
+                similar_neighbours[sub_matrix[i * COLUMNS + j] == AGENT_X] += similar;     // Vicini simili per gruppo (0: 'O', 1: 'X')
 
                 // Se l'agente non è soddisfatto, viene incrementato il numero degli agenti insoddisfatti (servirà per il calcolo delle destinazioni possibili)
                 if (mat[i * COLUMNS + j] == 1)
@@ -326,9 +720,9 @@ int *calculate_move(int rank, int world_size, int original_rows, int total_rows,
 /*** Fine funzine per calcolare gli agenti che si vogliono spostare ***/
 
 /*** Inizio funzione per calcolare se un agente è sodisfatto ***/
-int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int row, int column, char *sub_matrix) {
+int is_satisfied(int rank, int world_size, int rows_size, int total_rows, cellIndex row, int column, char *sub_matrix, int *similar_neighbours) {
     int left_index, right_index;
-    int ngh_precedent_row, ngh_next_row;  // Righe dei processi adiacenti
+    cellIndex ngh_precedent_row, ngh_next_row;  // Righe dei processi adiacenti
     char neighbours[8];                   // Matrice delle 8 celle adiacenti ad un agente
 
     char current_element = sub_matrix[row + column];
@@ -342,13 +736,13 @@ int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int ro
     // Calcolo la posizione delle righe precedenti e successive (rappresentano le celle sopra e sotto l'agente)
     if (rank == 0) {
         ngh_precedent_row = -1;                                // Non ci sono righe precedenti
-        ngh_next_row = total_rows * COLUMNS - COLUMNS;         // Posizione della riga successiva all'ultima del processo
+        ngh_next_row = (cellIndex)total_rows * COLUMNS - COLUMNS;    // Posizione della riga successiva all'ultima del processo
     } else if (rank == world_size - 1) {                       // Non ha righe successive
-        ngh_precedent_row = total_rows * COLUMNS - COLUMNS;
+        ngh_precedent_row = (cellIndex)total_rows * COLUMNS - COLUMNS;
         ngh_next_row = -1;                                     // Non ha righe successive
     } else {                                                   // Processi con righe centrali
-        ngh_precedent_row = total_rows * COLUMNS - COLUMNS - COLUMNS;
-        ngh_next_row = total_rows * COLUMNS - COLUMNS;
+        ngh_precedent_row = (cellIndex)total_rows * COLUMNS - COLUMNS - COLUMNS;
+        ngh_next_row = (cellIndex)total_rows * COLUMNS - COLUMNS;
     }
 
     if (row != 0) {
@@ -386,7 +780,7 @@ int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int ro
     neighbours[4] = right_index != -1 ? sub_matrix[row + right_index] : '\0';
 
     // Riga successiva
-    if (row != rows_size - 1) {
+    if (row / COLUMNS != rows_size - 1) {     // row è la posizione di inizio riga (indice * COLUMNS)
         if (left_index != -1)                                          // L'elemento a sinistra esiste
             neighbours[5] = sub_matrix[row + COLUMNS + left_index];
         else                                                           // L'elemento a sinistra non esiste
@@ -398,13 +792,13 @@ int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int ro
             neighbours[5] = '\0';
     }
 
-    if (row != rows_size - 1) {
+    if (row / COLUMNS != rows_size - 1) {
         neighbours[6] = sub_matrix[row + COLUMNS + column];
     } else {
         neighbours[6] = rank == world_size - 1 ? '\0' : sub_matrix[ngh_next_row + column];
     }
 
-    if (row != rows_size - 1) {
+    if (row / COLUMNS != rows_size - 1) {
         if (right_index != -1)                                         // L'elemento a destra esiste
             neighbours[7] = sub_matrix[row + COLUMNS + right_index];
         else                                                           // L'elemento a destra non esiste
@@ -424,6 +818,10 @@ int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int ro
             neighbours_count--;
     }
 
+    // Numero di vicini simili, se richiesto
+    if (similar_neighbours != NULL)
+        *similar_neighbours = similar;
+
     // Calcolo della soddisfazione
     if ((((double)100 / neighbours_count) * similar) >= SAT_PERCENTAGE)
         return 1;
@@ -433,8 +831,8 @@ int is_satisfied(int rank, int world_size, int rows_size, int total_rows, int ro
 /*** Fine funzione per calcolare se un agente è sodisfatto **/
 
 /*** Inizio funzione per calcolare il numero di celle vuote locali ad un processo ***/
-voidCell *calculate_local_void_cells(int original_rows, char *sub_matrix, int displacement, int *local_void_cells) {
-    voidCell *void_cells;    // Array che contiene le celle vuote ([riga][colonna]) -> ([riga * COLUMNS + colonna])
+voidCell *calculate_local_void_cells(int original_rows, char *sub_matrix, cellIndex displacement, int *local_void_cells) {
+    voidCell *void_cells;    // Array che contiene le celle vuote ([riga][colonna]) -> ([riga * COLUMNS + colonna]), con l'indice globale
     int ind = 0;             // Indice che indica quante celle vuote ha trovato. Alla fine lo assegna a 'local_void_cells'
 
     void_cells = malloc(original_rows * COLUMNS * sizeof(voidCell));
@@ -443,7 +841,7 @@ voidCell *calculate_local_void_cells(int original_rows, char *sub_matrix, int di
     for (int i = 0; i < original_rows; i++)
         for (int j = 0; j < COLUMNS; j++)
             if (sub_matrix[i * COLUMNS + j] == EMPTY) {
-                voidCell temp = {(displacement + i * COLUMNS), j};
+                voidCell temp = {displacement + i * COLUMNS + j};
                 void_cells[ind] = temp;
                 ind++;
             }
@@ -455,17 +853,179 @@ voidCell *calculate_local_void_cells(int original_rows, char *sub_matrix, int di
 }
 /*** Fine funzione per calcolare il numero di celle vuote locali ad un processo ***/
 
+/*** Inizio funzione per calcolare in un'unica passata gli agenti da spostare e le celle vuote ***/
+signed char *calculate_move_and_void_cells(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, cellIndex displacement, int *unsatisfied_agents, long long *similar_neighbours, voidCell **local_void_cells, int *number_of_local_void_cells) {
+    signed char *mat = (signed char *)malloc(original_rows * COLUMNS * sizeof(signed char));     // Stessa codifica di calculate_move (-1: vuota, 0: soddisfatto, 1: insoddisfatto)
+    voidCell *void_cells = malloc(original_rows * COLUMNS * sizeof(voidCell));                 // Celle vuote, nello stesso ordine di calculate_local_void_cells
+    int ind = 0;                                                                               // Numero di celle vuote trovate
+
+    // Posizione delle righe dei processi adiacenti (come in is_satisfied)
+    char *ngh_precedent_row = NULL;
+    char *ngh_next_row = NULL;
+    if (rank != 0)
+        ngh_precedent_row = sub_matrix + (total_rows - ((rank == world_size - 1) ? 1 : 2)) * COLUMNS;
+    if (rank != world_size - 1)
+        ngh_next_row = sub_matrix + (total_rows - 1) * COLUMNS;
+
+    *unsatisfied_agents = 0;
+    similar_neighbours[0] = similar_neighbours[1] = 0;
+
+    // Per ogni riga vengono individuate una sola volta la riga superiore e quella inferiore (locali o dei vicini)
+    for (int i = 0; i < original_rows; i++) {
+        char *row = sub_matrix + i * COLUMNS;
+        char *up = i != 0 ? row - COLUMNS : ngh_precedent_row;
+        char *down = i != original_rows - 1 ? row + COLUMNS : ngh_next_row;
+
+        for (int j = 0; j < COLUMNS; j++) {
+            int state = classify_cell(row, up, down, j, similar_neighbours);
+
+            mat[i * COLUMNS + j] = state;
+            if (state == -1) {                  // La cella è vuota (è libera per chi vuole spostarsi)
+                voidCell temp = {displacement + i * COLUMNS + j};
+                void_cells[ind++] = temp;
+            } else
+                *unsatisfied_agents += state;
+        }
+    }
+
+    *local_void_cells = realloc(void_cells, ind * sizeof(voidCell));
+    *number_of_local_void_cells = ind;
+
+    return mat;
+}
+/*** Fine funzione per calcolare in un'unica passata gli agenti da spostare e le celle vuote ***/
+
+/*** Inizio funzione per calcolare la passata unica a blocchi ***/
+signed char *calculate_move_and_void_cells_tiled(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, cellIndex displacement, int *unsatisfied_agents, long long *similar_neighbours, voidCell **local_void_cells, int *number_of_local_void_cells) {
+    signed char *mat = (signed char *)malloc(original_rows * COLUMNS * sizeof(signed char));     // Stessa codifica di calculate_move (-1: vuota, 0: soddisfatto, 1: insoddisfatto)
+    voidCell *void_cells = malloc(original_rows * COLUMNS * sizeof(voidCell));                 // Celle vuote, nello stesso ordine di calculate_local_void_cells
+    voidCell *band_void_cells = malloc(TILE_ROWS * COLUMNS * sizeof(voidCell));                // Celle vuote di una fascia di blocchi, divise per riga
+    char tile[(TILE_ROWS + 2) * (TILE_COLUMNS + 2)];                                            // Blocco con la cornice delle celle adiacenti ('\0' fuori dalla matrice)
+    int row_void_cells[TILE_ROWS];                                                              // Celle vuote trovate in ogni riga della fascia
+    int ind = 0;                                                                                // Numero di celle vuote trovate
+
+    // Posizione delle righe dei processi adiacenti (come in is_satisfied)
+    char *ngh_precedent_row = NULL;
+    char *ngh_next_row = NULL;
+    if (rank != 0)
+        ngh_precedent_row = sub_matrix + (total_rows - ((rank == world_size - 1) ? 1 : 2)) * COLUMNS;
+    if (rank != world_size - 1)
+        ngh_next_row = sub_matrix + (total_rows - 1) * COLUMNS;
+
+    *unsatisfied_agents = 0;
+    similar_neighbours[0] = similar_neighbours[1] = 0;
+
+    // I blocchi vengono visitati per fasce di TILE_ROWS righe, da sinistra a destra
+    for (int first_row = 0; first_row < original_rows; first_row += TILE_ROWS) {
+        int rows = original_rows - first_row < TILE_ROWS ? original_rows - first_row : TILE_ROWS;
+
+        memset(row_void_cells, 0, sizeof(row_void_cells));
+        for (int first_column = 0; first_column < COLUMNS; first_column += TILE_COLUMNS) {
+            int columns = COLUMNS - first_column < TILE_COLUMNS ? COLUMNS - first_column : TILE_COLUMNS;
+            int width = columns + 2;
+
+            // Il blocco viene copiato con una cornice: righe dei vicini ai bordi della sottomatrice, '\0' ai bordi della matrice
+            for (int i = -1; i <= rows; i++) {
+                char *source = first_row + i < 0 ? ngh_precedent_row : first_row + i >= original_rows ? ngh_next_row : sub_matrix + (first_row + i) * COLUMNS;
+                char *packed = tile + (i + 1) * width;
+
+                if (source == NULL) {
+                    memset(packed, '\0', width);
+                    continue;
+                }
+                packed[0] = first_column > 0 ? source[first_column - 1] : '\0';
+                memcpy(packed + 1, source + first_column, columns);
+                packed[columns + 1] = first_column + columns < COLUMNS ? source[first_column + columns] : '\0';
+            }
+
+            // Con la cornice ogni cella ha sempre 8 posizioni adiacenti: quelle '\0' non vengono contate
+            for (int i = 0; i < rows; i++) {
+                char *up = tile + i * width + 1;
+                char *row = up + width;
+                char *down = row + width;
+                int cell = (first_row + i) * COLUMNS + first_column;
+
+                for (int j = 0; j < columns; j++, cell++) {
+                    char agent = row[j];
+
+                    if (agent == EMPTY) {
+                        mat[cell] = -1;
+                        voidCell temp = {displacement + cell};
+                        band_void_cells[i * COLUMNS + row_void_cells[i]++] = temp;
+                        continue;
+                    }
+
+                    int similar = (up[j - 1] == agent) + (up[j] == agent) + (up[j + 1] == agent) + (row[j - 1] == agent) +
+                                  (row[j + 1] == agent) + (down[j - 1] == agent) + (down[j] == agent) + (down[j + 1] == agent);
+                    int neighbours_count = (up[j - 1] != '\0') + (up[j] != '\0') + (up[j + 1] != '\0') + (row[j - 1] != '\0') +
+                                           (row[j + 1] != '\0') + (down[j - 1] != '\0') + (down[j] != '\0') + (down[j + 1] != '\0');
+
+                    similar_neighbours[agent == AGENT_X] += similar;     // Vicini simili per gruppo (0: 'O', 1: 'X')
+
+                    // Stessa condizione di is_satisfied
+                    if ((((double)100 / neighbours_count) * similar) >= SAT_PERCENTAGE)
+                        mat[cell] = 0;
+                    else {
+                        mat[cell] = 1;
+                        *unsatisfied_agents += 1;
+                    }
+                }
+            }
+        }
+
+        // Le celle vuote della fascia tornano in ordine di riga (in ogni riga i blocchi sono già da sinistra a destra)
+        for (int i = 0; i < rows; i++) {
+            memcpy(void_cells + ind, band_void_cells + i * COLUMNS, row_void_cells[i] * sizeof(voidCell));
+            ind += row_void_cells[i];
+        }
+    }
+
+    free(band_void_cells);
+    *local_void_cells = realloc(void_cells, ind * sizeof(voidCell));
+    *number_of_local_void_cells = ind;
+
+    return mat;
+}
+/*** Fine funzione per calcolare la passata unica a blocchi ***/
+
+/*** Inizio funzione per classificare una cella dalla sua finestra 3x3 ***/
+int classify_cell(char *row, char *up, char *down, int column, long long *similar_neighbours) {
+    char agent = row[column];
+
+    if (agent == EMPTY)
+        return -1;
+
+    // Righe e colonne della finestra 3x3 interne alla matrice (up e down sono NULL ai bordi)
+    int rows_in_window = 1 + (up != NULL) + (down != NULL);
+    int first = column != 0 ? column - 1 : column;
+    int last = column != COLUMNS - 1 ? column + 1 : column;
+    int neighbours_count = rows_in_window * (last - first + 1) - 1;
+    int similar = -1;    // L'agente stesso viene contato nella finestra
+
+    for (int k = first; k <= last; k++) {
+        similar += row[k] == agent;
+        if (up != NULL)
+            similar += up[k] == agent;
+        if (down != NULL)
+            similar += down[k] == agent;
+    }
+
+    similar_neighbours[agent == AGENT_X] += similar;     // Vicini simili per gruppo (0: 'O', 1: 'X')
+
+    // Stessa condizione di is_satisfied
+    return (((double)100 / neighbours_count) * similar) >= SAT_PERCENTAGE ? 0 : 1;
+}
+/*** Fine funzione per classificare una cella dalla sua finestra 3x3 ***/
+
 /*** Inizio funzione per unire tutte le celle vuote dei processi e restituire quelle di destinazione per il processo i-esimo ***/
-voidCell *assign_void_cells(int rank, int world_size, int number_of_local_void_cells, voidCell *local_void_cells, int *number_of_void_cells_to_return, MPI_Datatype datatype, int unsatisfied_agents) {
+voidCell *assign_void_cells(int rank, int world_size, int number_of_local_void_cells, voidCell *local_void_cells, int *number_of_void_cells_to_return, MPI_Datatype datatype, int unsatisfied_agents, int compress, pipelineState *pipeline) {
     int number_of_global_void_cells[world_size];     // Array che contiene il numero di celle vuote per ogni processo
-    int displacements[world_size];                   // Displacements per la prima gather (displs[rank] == numero di celle vuote del rank)
-    int number_of_total_void_cells = 0;              // Numero di celle vuote in tutta la matrice
+    cellIndex displacements[world_size];             // Displacements per la prima gather (displs[rank] == numero di celle vuote del rank)
+    cellIndex number_of_total_void_cells = 0;        // Numero di celle vuote in tutta la matrice
     voidCell *global_void_cells;                     // Array con tutte le posizioni delle celle vuote - es. { [0][1], [3][2], [5][8] }
-    int *void_cells_per_process;                     // Array che indica quante celle vuote vengono assegnate ad un processo
-    int global_unsatisfied_agents[world_size];       // Array che contiene il numero degli agenti insoddisfatti per ogni processo
-
-    global_void_cells = malloc(ROWS * COLUMNS * sizeof(voidCell));
-    void_cells_per_process = malloc(ROWS * COLUMNS * sizeof(voidCell));
+    cellIndex void_cells_per_process[world_size];    // Array che indica quante celle vuote vengono assegnate ad un processo
+    int unsatisfied_per_process[world_size];         // Array che contiene il numero degli agenti insoddisfatti per ogni processo
+    cellIndex global_unsatisfied_agents[world_size]; // Come unsatisfied_per_process, per split_void_cells
 
     // Il numero di celle vuote di ogni processo viene condiviso con tutti gli altri
     MPI_Allgather(&number_of_local_void_cells, 1, MPI_INT, number_of_global_void_cells, 1, MPI_INT, MPI_COMM_WORLD);       // (sendbuff, sendcount, datatype, destbuff, destcount, datatype, comm)
@@ -475,70 +1035,440 @@ voidCell *assign_void_cells(int rank, int world_size, int number_of_local_void_c
         displacements[i] = i == 0 ? 0 : displacements[i - 1] + number_of_global_void_cells[i - 1];
         number_of_total_void_cells += number_of_global_void_cells[i];
     }
+    global_void_cells = malloc((size_t)number_of_total_void_cells * sizeof(voidCell));
 
-    // Vengono raggruppate tutte le celle vuote
-    MPI_Allgatherv(local_void_cells, number_of_local_void_cells, datatype, global_void_cells, number_of_global_void_cells, displacements, datatype, MPI_COMM_WORLD);        // (sendbuff, sendcount, senddatatype, destbuff, destcount, displacements, destdatatype, comm)
+    // Vengono raggruppate tutte le celle vuote, compresse se sono tante (tutti i processi conoscono i conteggi e prendono la stessa decisione)
+    int encodable = 1;
+    for (int i = 0; i < world_size; i++)
+        encodable &= ENCODABLE(number_of_global_void_cells[i]);
+
+    if (compress && encodable && number_of_total_void_cells * sizeof(voidCell) > COMPRESS_THRESHOLD) {
+        int encoded_sizes[world_size];                 // Byte compressi di ogni processo
+        cellIndex encoded_displacements[world_size];   // Displacements dei byte compressi
+        unsigned char *encoded = malloc(MAX_ENCODED_SIZE(number_of_local_void_cells));
+        int bytes = encode_void_cells(local_void_cells, number_of_local_void_cells, encoded);
+
+        MPI_Allgather(&bytes, 1, MPI_INT, encoded_sizes, 1, MPI_INT, MPI_COMM_WORLD);
+        for (int i = 0; i < world_size; i++)
+            encoded_displacements[i] = i == 0 ? 0 : encoded_displacements[i - 1] + encoded_sizes[i - 1];
+
+        unsigned char *all_encoded = malloc((size_t)encoded_displacements[world_size - 1] + encoded_sizes[world_size - 1]);
+        memcpy(all_encoded + encoded_displacements[rank], encoded, bytes);
+        allgatherv_cells(all_encoded, encoded_sizes, encoded_displacements, MPI_BYTE, MPI_COMM_WORLD);
+        for (int i = 0; i < world_size; i++)
+            decode_void_cells(all_encoded + encoded_displacements[i], number_of_global_void_cells[i], global_void_cells + displacements[i]);
+
+        free(encoded);
+        free(all_encoded);
+    } else {
+        memcpy(global_void_cells + displacements[rank], local_void_cells, number_of_local_void_cells * sizeof(voidCell));
+        allgatherv_cells(global_void_cells, number_of_global_void_cells, displacements, datatype, MPI_COMM_WORLD);
+    }
 
     // Il numero di agenti insoddisfatti per ogni processo viene messo in un array
-    MPI_Allgather(&unsatisfied_agents, 1, MPI_INT, global_unsatisfied_agents, 1, MPI_INT, MPI_COMM_WORLD);     // (sendubb, sendcount, datatype, destbuff, destcount, datatype, comm)
+    MPI_Allgather(&unsatisfied_agents, 1, MPI_INT, unsatisfied_per_process, 1, MPI_INT, MPI_COMM_WORLD);     // (sendubb, sendcount, datatype, destbuff, destcount, datatype, comm)
+    for (int i = 0; i < world_size; i++)
+        global_unsatisfied_agents[i] = unsatisfied_per_process[i];
 
     // L'array con le celle vuote viene mescolato, viene usato lo stesso seme per ogni processo
     srand(SEED);                      // Inizzializza il seme
-    for (int i = 0; i < number_of_total_void_cells; i++) {
-        int destination = ((rand() % (number_of_total_void_cells)) + 0);
+    for (cellIndex i = 0; i < number_of_total_void_cells; i++) {
+        cellIndex destination = random_index(number_of_total_void_cells);
         voidCell tmp = global_void_cells[destination];
         global_void_cells[destination] = global_void_cells[i];
         global_void_cells[i] = tmp;
     }
 
     // Calcolo le posizioni locali al processo e Vengono assegnate le celle vuote ai processi
-    int divisione = number_of_total_void_cells / world_size;           // Celle vuote da asseganre ad ogni processo
-    int resto = number_of_total_void_cells % world_size;               // Resto se != 0 bisogna assegnare più celle vuote ad un processo
-    int displacement = 0;
-    for (int i = 0; i < world_size; i++) {
-        void_cells_per_process[i] = divisione > global_unsatisfied_agents[i] ? global_unsatisfied_agents[i] : divisione;
-
-        if (resto > 0 && !(divisione > global_unsatisfied_agents[i])) {
-            void_cells_per_process[i]++;
-            resto--;
-        }
-
-        displacements[i] = displacement;
-        displacement += void_cells_per_process[i];
+    split_void_cells(number_of_total_void_cells, world_size, global_unsatisfied_agents, void_cells_per_process, displacements);
+
+    // Tutti conoscono tutte le assegnazioni: le celle del processo date agli altri sono quelle dove possono arrivare agenti (PIPELINE)
+    if (pipeline != NULL) {
+        cellIndex first_cell = pipeline->displacements[rank];
+        cellIndex last_cell = first_cell + pipeline->sendcounts[rank];
+
+        memset(pipeline->arrivals_from, 0, world_size * sizeof(int));
+        memset(pipeline->departures_to, 0, world_size * sizeof(int));
+        pipeline->pending = realloc(pipeline->pending, number_of_local_void_cells * sizeof(cellIndex));
+        pipeline->number_of_pending = 0;
+
+        for (int i = 0; i < world_size; i++)
+            for (cellIndex k = displacements[i]; k < displacements[i] + void_cells_per_process[i]; k++) {
+                cellIndex cell = global_void_cells[k].cell_index;
+
+                if (i == rank)
+                    pipeline->departures_to[calculate_source(world_size, pipeline->displacements, cell)]++;
+                else if (cell >= first_cell && cell < last_cell) {
+                    pipeline->arrivals_from[i]++;
+                    pipeline->pending[pipeline->number_of_pending++] = cell - first_cell;
+                }
+            }
+        pipeline->departures_to[rank] = 0;     // Gli spostamenti interni al processo sono immediati
     }
 
-    // Ad ogni processo viene assegnato un numero di celle vuote
+    // Ad ogni processo viene assegnato un numero di celle vuote (non supera i suoi agenti insoddisfatti), che ha già nell'array globale
     *number_of_void_cells_to_return = void_cells_per_process[rank];
     voidCell *toReturn = malloc(sizeof(voidCell) * void_cells_per_process[rank]);      // Contiene le celle vuote da assegnare ad ogni processo
-    MPI_Scatterv(global_void_cells, void_cells_per_process, displacements, datatype, toReturn, void_cells_per_process[rank], datatype, MASTER, MPI_COMM_WORLD);    // (sendbuff, sendcount, displacements, datatype, destbuff, destcount, datatype, root, comm)
+    memcpy(toReturn, global_void_cells + displacements[rank], void_cells_per_process[rank] * sizeof(voidCell));
 
     free(global_void_cells);
-    free(void_cells_per_process);
 
     return toReturn;
 }
 /*** Fine funzione per unire tutte le celle vuote dei processi e restituire quelle di destinazione per il processo i-esimo ***/
 
-/*** Inizo funzione per calcolare a quale processo appartiene una determinata riga della matrice ***/
-int calculate_source(int world_size, int *displacement, int *sendcounts, int row) {
-    int toReturn = 0;
+/*** Inizio funzione per calcolare quante celle vuote spettano ad ogni processo (o nodo) ***/
+void split_void_cells(cellIndex number_of_void_cells, int parts, cellIndex *unsatisfied_agents, cellIndex *void_cells_per_part, cellIndex *displacements) {
+    cellIndex divisione = number_of_void_cells / parts;     // Celle vuote da asseganre ad ogni processo
+    cellIndex resto = number_of_void_cells % parts;         // Resto se != 0 bisogna assegnare più celle vuote ad un processo
 
-    // Si calcola a quale processo (rank) appartiene una cella di destinazione
-    for (int tmp_rank = 0; tmp_rank < world_size; tmp_rank++) {
-        int start = displacement[tmp_rank] / COLUMNS;
-        int finish = (start + sendcounts[tmp_rank] / COLUMNS);
+    split_shares(divisione, resto, parts, unsatisfied_agents, void_cells_per_part, displacements);
+}
+/*** Fine funzione per calcolare quante celle vuote spettano ad ogni processo (o nodo) ***/
+
+/*** Inizio funzione per dividere le celle vuote data la quota di ogni processo e le celle in più ***/
+cellIndex split_shares(cellIndex divisione, cellIndex resto, int parts, cellIndex *unsatisfied_agents, cellIndex *void_cells_per_part, cellIndex *displacements) {
+    cellIndex displacement = 0;
+
+    // Ogni processo riceve al massimo divisione celle (non più dei suoi agenti insoddisfatti), e le celle in più vanno ai primi che ne hanno bisogno
+    for (int i = 0; i < parts; i++) {
+        void_cells_per_part[i] = divisione > unsatisfied_agents[i] ? unsatisfied_agents[i] : divisione;
 
-        if (row >= start && row < finish) {
-            toReturn = tmp_rank;
-            break;
+        if (resto > 0 && !(divisione > unsatisfied_agents[i])) {
+            void_cells_per_part[i]++;
+            resto--;
         }
+
+        displacements[i] = displacement;
+        displacement += void_cells_per_part[i];
     }
+
+    return resto;
+}
+/*** Fine funzione per dividere le celle vuote data la quota di ogni processo e le celle in più ***/
+
+/*** Inizio funzione per estrarre un indice casuale tra 0 e n - 1 (anche oltre RAND_MAX) ***/
+cellIndex random_index(cellIndex n) {
+    if (n <= RAND_MAX)
+        return rand() % n;    // Stessa estrazione di sempre finché il totale sta in una chiamata a rand()
+
+    // Più chiamate a rand() vengono concatenate fino a coprire n
+    unsigned long long value = 0, range = 1;
+    while (range < (unsigned long long)n) {
+        value = value * ((unsigned long long)RAND_MAX + 1) + rand();
+        range *= (unsigned long long)RAND_MAX + 1;
+    }
+
+    return value % n;
+}
+/*** Fine funzione per estrarre un indice casuale tra 0 e n - 1 (anche oltre RAND_MAX) ***/
+
+/*** Inizio funzione come MPI_Allgatherv (sul posto) ma con displacements a 64 bit ***/
+void allgatherv_cells(void *buffer, int *counts, cellIndex *displacements, MPI_Datatype datatype, MPI_Comm comm) {
+#if LARGE_GRID
+    // I displacements di MPI sono int: ogni processo trasmette il proprio blocco a partire dal suo indirizzo
+    MPI_Aint lower_bound, extent;
+    int size;
+
+    MPI_Type_get_extent(datatype, &lower_bound, &extent);
+    MPI_Comm_size(comm, &size);
+    for (int i = 0; i < size; i++)
+        MPI_Bcast((char *)buffer + displacements[i] * extent, counts[i], datatype, i, comm);
+#else
+    MPI_Allgatherv(MPI_IN_PLACE, 0, datatype, buffer, counts, displacements, datatype, comm);    // (sendbuff, sendcount, senddatatype, destbuff, destcount, displacements, destdatatype, comm)
+#endif
+}
+/*** Fine funzione come MPI_Allgatherv (sul posto) ma con displacements a 64 bit ***/
+
+/*** Inizio funzione come MPI_Gatherv ma con displacements a 64 bit ***/
+void gatherv_cells(void *send_buffer, int send_count, void *receive_buffer, int *receive_counts, cellIndex *displacements, MPI_Datatype datatype, int root, MPI_Comm comm) {
+#if LARGE_GRID
+    MPI_Aint lower_bound, extent;
+    int rank, size;
+
+    MPI_Type_get_extent(datatype, &lower_bound, &extent);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (rank != root) {
+        MPI_Send(send_buffer, send_count, datatype, root, CELLS_TAG, comm);
+        return;
+    }
+
+    MPI_Request requests[size];
+    for (int i = 0; i < size; i++)
+        if (i == root) {
+            memcpy((char *)receive_buffer + displacements[i] * extent, send_buffer, send_count * extent);
+            requests[i] = MPI_REQUEST_NULL;
+        } else
+            MPI_Irecv((char *)receive_buffer + displacements[i] * extent, receive_counts[i], datatype, i, CELLS_TAG, comm, &requests[i]);
+    MPI_Waitall(size, requests, MPI_STATUSES_IGNORE);
+#else
+    MPI_Gatherv(send_buffer, send_count, datatype, receive_buffer, receive_counts, displacements, datatype, root, comm);
+#endif
+}
+/*** Fine funzione come MPI_Gatherv ma con displacements a 64 bit ***/
+
+/*** Inizio funzione come MPI_Scatterv ma con displacements a 64 bit ***/
+void scatterv_cells(void *send_buffer, int *send_counts, cellIndex *displacements, void *receive_buffer, int receive_count, MPI_Datatype datatype, int root, MPI_Comm comm) {
+#if LARGE_GRID
+    MPI_Aint lower_bound, extent;
+    int rank, size;
+
+    MPI_Type_get_extent(datatype, &lower_bound, &extent);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (rank != root) {
+        MPI_Recv(receive_buffer, receive_count, datatype, root, CELLS_TAG, comm, MPI_STATUS_IGNORE);
+        return;
+    }
+
+    MPI_Request requests[size];
+    for (int i = 0; i < size; i++)
+        if (i == root) {
+            memcpy(receive_buffer, (char *)send_buffer + displacements[i] * extent, receive_count * extent);
+            requests[i] = MPI_REQUEST_NULL;
+        } else
+            MPI_Isend((char *)send_buffer + displacements[i] * extent, send_counts[i], datatype, i, CELLS_TAG, comm, &requests[i]);
+    MPI_Waitall(size, requests, MPI_STATUSES_IGNORE);
+#else
+    MPI_Scatterv(send_buffer, send_counts, displacements, datatype, receive_buffer, receive_count, datatype, root, comm);
+#endif
+}
+/*** Fine funzione come MPI_Scatterv ma con displacements a 64 bit ***/
+
+/*** Inizio funzione come MPI_Alltoallv ma con displacements a 64 bit ***/
+void alltoallv_cells(void *send_buffer, int *send_counts, cellIndex *send_displacements, void *receive_buffer, int *receive_counts, cellIndex *receive_displacements, MPI_Datatype datatype, MPI_Comm comm) {
+#if LARGE_GRID
+    MPI_Aint lower_bound, extent;
+    int rank, size;
+
+    MPI_Type_get_extent(datatype, &lower_bound, &extent);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    MPI_Request requests[2 * size];
+    for (int i = 0; i < size; i++) {
+        requests[i] = requests[size + i] = MPI_REQUEST_NULL;
+        if (i == rank)
+            memcpy((char *)receive_buffer + receive_displacements[i] * extent, (char *)send_buffer + send_displacements[i] * extent, send_counts[i] * extent);
+        else {
+            MPI_Irecv((char *)receive_buffer + receive_displacements[i] * extent, receive_counts[i], datatype, i, CELLS_TAG, comm, &requests[i]);
+            MPI_Isend((char *)send_buffer + send_displacements[i] * extent, send_counts[i], datatype, i, CELLS_TAG, comm, &requests[size + i]);
+        }
+    }
+    MPI_Waitall(2 * size, requests, MPI_STATUSES_IGNORE);
+#else
+    MPI_Alltoallv(send_buffer, send_counts, send_displacements, datatype, receive_buffer, receive_counts, receive_displacements, datatype, comm);
+#endif
+}
+/*** Fine funzione come MPI_Alltoallv ma con displacements a 64 bit ***/
+
+/*** Inizio funzione per assegnare le celle vuote prima tra i nodi e poi tra i processi di ogni nodo ***/
+voidCell *assign_void_cells_hierarchical(nodeInfo *node, int number_of_local_void_cells, voidCell *local_void_cells, int *number_of_void_cells_to_return, MPI_Datatype datatype, int unsatisfied_agents, int compress) {
+    int local_counts[2] = {number_of_local_void_cells, unsatisfied_agents};    // Celle vuote e agenti insoddisfatti del processo
+    int *node_counts = NULL;                 // Celle vuote e agenti insoddisfatti di ogni processo del nodo (solo leader)
+    int *node_void_cells = NULL;             // Numero di celle vuote di ogni processo del nodo (solo leader)
+    cellIndex *node_unsatisfied = NULL;      // Numero di agenti insoddisfatti di ogni processo del nodo (solo leader)
+    cellIndex *node_displacements = NULL;    // Displacements per le comunicazioni nel nodo (solo leader)
+    voidCell *gathered_void_cells = NULL;    // Celle vuote di tutto il nodo (solo leader)
+    voidCell *assigned_void_cells = NULL;    // Celle vuote assegnate al nodo (solo leader)
+    cellIndex *void_cells_per_process = NULL;    // Celle vuote assegnate ad ogni processo del nodo (solo leader)
+    int *process_counts = NULL;              // Come void_cells_per_process, per le comunicazioni (non supera gli agenti insoddisfatti del processo)
+    cellIndex number_of_node_void_cells = 0; // Celle vuote del nodo
+
+    // Primo livello: ogni leader raccoglie i conteggi e le celle vuote del proprio nodo
+    if (node->node_rank == 0) {
+        node_counts = malloc(node->node_size * 2 * sizeof(int));
+        node_void_cells = malloc(node->node_size * sizeof(int));
+        node_unsatisfied = malloc(node->node_size * sizeof(cellIndex));
+        node_displacements = malloc(node->node_size * sizeof(cellIndex));
+        void_cells_per_process = malloc(node->node_size * sizeof(cellIndex));
+        process_counts = malloc(node->node_size * sizeof(int));
+    }
+    MPI_Gather(local_counts, 2, MPI_INT, node_counts, 2, MPI_INT, 0, node->node_comm);
+
+    if (node->node_rank == 0) {
+        for (int i = 0; i < node->node_size; i++) {
+            node_void_cells[i] = node_counts[i * 2];
+            node_unsatisfied[i] = node_counts[i * 2 + 1];
+            node_displacements[i] = number_of_node_void_cells;
+            number_of_node_void_cells += node_void_cells[i];
+        }
+        gathered_void_cells = malloc((size_t)number_of_node_void_cells * sizeof(voidCell));
+    }
+    gatherv_cells(local_void_cells, number_of_local_void_cells, gathered_void_cells, node_void_cells, node_displacements, datatype, 0, node->node_comm);
+
+    // Secondo livello: i leader si scambiano solo i totali dei nodi e decidono quante celle ogni nodo cede agli altri
+    if (node->node_rank == 0) {
+        int nodes = node->number_of_nodes;
+        int world_size;
+        cellIndex node_shares[2] = {0, 0};                                   // Celle spettanti ai processi del nodo con la regola alla pari e processi del nodo che possono ricevere una cella in più
+        cellIndex *shares = malloc(nodes * 2 * sizeof(cellIndex));           // node_shares di tutti i nodi
+        cellIndex *void_cells_per_node = malloc(nodes * sizeof(cellIndex));  // Numero di celle vuote di ogni nodo (non ancora assegnate)
+        cellIndex *quota = malloc(nodes * sizeof(cellIndex));                // Celle vuote assegnate ad ogni nodo
+        cellIndex *extra = malloc(nodes * sizeof(cellIndex));                // Celle in più (resto della divisione) assegnate ad ogni nodo
+        int *transfers = calloc(nodes * nodes, sizeof(int));     // transfers[i * nodes + j]: celle vuote del nodo i assegnate al nodo j
+        cellIndex *send_displacements = malloc(nodes * sizeof(cellIndex));
+        int *receive_counts = malloc(nodes * sizeof(int));
+        cellIndex *receive_displacements = malloc(nodes * sizeof(cellIndex));
+        cellIndex number_of_total_void_cells = 0;
+
+        MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+        MPI_Allgather(&number_of_node_void_cells, 1, MPI_CELL_INDEX, void_cells_per_node, 1, MPI_CELL_INDEX, node->leader_comm);
+        for (int i = 0; i < nodes; i++)
+            number_of_total_void_cells += void_cells_per_node[i];
+
+        // Ogni processo riceve quanto riceverebbe con l'assegnazione alla pari: al massimo il totale diviso per tutti i processi (non per quelli del nodo),
+        // così le celle che un processo non usa non restano bloccate nella quota del suo nodo
+        cellIndex divisione = number_of_total_void_cells / world_size;
+        cellIndex resto = number_of_total_void_cells % world_size;
+        for (int i = 0; i < node->node_size; i++) {
+            node_shares[0] += divisione > node_unsatisfied[i] ? node_unsatisfied[i] : divisione;
+            node_shares[1] += !(divisione > node_unsatisfied[i]);
+        }
+        MPI_Allgather(node_shares, 2, MPI_CELL_INDEX, shares, 2, MPI_CELL_INDEX, node->leader_comm);
+
+        // Le celle in più vanno ai nodi in ordine, come ai processi nella regola alla pari
+        for (int i = 0; i < nodes; i++) {
+            extra[i] = resto < shares[i * 2 + 1] ? resto : shares[i * 2 + 1];
+            resto -= extra[i];
+            quota[i] = shares[i * 2] + extra[i];
+        }
+
+        // Ogni cella della quota di un nodo viene estratta a caso (senza reinserimento) tra le celle vuote di tutti i nodi, con lo stesso seme per ogni leader
+        srand(SEED);
+        cellIndex remaining = number_of_total_void_cells;
+        for (int j = 0; j < nodes; j++)
+            for (cellIndex k = 0; k < quota[j]; k++) {
+                cellIndex extracted = random_index(remaining);
+                int source = 0;
+
+                // Nodo a cui appartiene la cella estratta, tra quelle non ancora assegnate
+                while (extracted >= void_cells_per_node[source]) {
+                    extracted -= void_cells_per_node[source];
+                    source++;
+                }
+
+                transfers[source * nodes + j]++;
+                void_cells_per_node[source]--;
+                remaining--;
+            }
+
+        // Le celle vuote del nodo vengono mescolate e cedute in blocchi ai nodi che le hanno ottenute
+        srand(SEED + node->node_id);
+        for (cellIndex i = 0; i < number_of_node_void_cells; i++) {
+            cellIndex destination = random_index(number_of_node_void_cells);
+            voidCell tmp = gathered_void_cells[destination];
+            gathered_void_cells[destination] = gathered_void_cells[i];
+            gathered_void_cells[i] = tmp;
+        }
+
+        for (int i = 0; i < nodes; i++) {
+            send_displacements[i] = i == 0 ? 0 : send_displacements[i - 1] + transfers[node->node_id * nodes + i - 1];
+            receive_counts[i] = transfers[i * nodes + node->node_id];
+            receive_displacements[i] = i == 0 ? 0 : receive_displacements[i - 1] + receive_counts[i - 1];
+        }
+
+        assigned_void_cells = malloc((size_t)quota[node->node_id] * sizeof(voidCell));
+
+        // Ogni blocco viene ordinato (il destinatario lo mescola comunque), così le differenze tra celle consecutive sono piccole e l'ordine non dipende da COMPRESS
+        for (int i = 0; i < nodes; i++)
+            qsort(gathered_void_cells + send_displacements[i], transfers[node->node_id * nodes + i], sizeof(voidCell), compare_void_cells);
+
+        // Le celle che passano tra i nodi vengono compresse se sono tante (tutti i leader conoscono transfers e prendono la stessa decisione)
+        cellIndex crossing_void_cells = 0;
+        int encodable = 1;
+        for (int i = 0; i < nodes * nodes; i++) {
+            crossing_void_cells += i / nodes != i % nodes ? transfers[i] : 0;
+            encodable &= ENCODABLE(transfers[i]);
+        }
+
+        if (compress && encodable && crossing_void_cells * sizeof(voidCell) > COMPRESS_THRESHOLD) {
+            int encoded_send_counts[nodes], encoded_receive_counts[nodes];
+            cellIndex encoded_send_displacements[nodes], encoded_receive_displacements[nodes];
+            unsigned char *encoded = malloc(MAX_ENCODED_SIZE(number_of_node_void_cells));
+            cellIndex bytes = 0;
+
+            for (int i = 0; i < nodes; i++) {
+                int count = transfers[node->node_id * nodes + i];
+                encoded_send_displacements[i] = bytes;
+                encoded_send_counts[i] = encode_void_cells(gathered_void_cells + send_displacements[i], count, encoded + bytes);
+                bytes += encoded_send_counts[i];
+            }
+
+            MPI_Alltoall(encoded_send_counts, 1, MPI_INT, encoded_receive_counts, 1, MPI_INT, node->leader_comm);
+            for (int i = 0; i < nodes; i++)
+                encoded_receive_displacements[i] = i == 0 ? 0 : encoded_receive_displacements[i - 1] + encoded_receive_counts[i - 1];
+
+            unsigned char *encoded_received = malloc((size_t)encoded_receive_displacements[nodes - 1] + encoded_receive_counts[nodes - 1]);
+            alltoallv_cells(encoded, encoded_send_counts, encoded_send_displacements, encoded_received, encoded_receive_counts, encoded_receive_displacements, MPI_BYTE, node->leader_comm);
+            for (int i = 0; i < nodes; i++)
+                decode_void_cells(encoded_received + encoded_receive_displacements[i], receive_counts[i], assigned_void_cells + receive_displacements[i]);
+
+            free(encoded);
+            free(encoded_received);
+        } else
+            alltoallv_cells(gathered_void_cells, transfers + node->node_id * nodes, send_displacements, assigned_void_cells, receive_counts, receive_displacements, datatype, node->leader_comm);
+
+        // Le celle ricevute dai diversi nodi vengono mescolate prima di dividerle tra i processi del nodo
+        for (cellIndex i = 0; i < quota[node->node_id]; i++) {
+            cellIndex destination = random_index(quota[node->node_id]);
+            voidCell tmp = assigned_void_cells[destination];
+            assigned_void_cells[destination] = assigned_void_cells[i];
+            assigned_void_cells[i] = tmp;
+        }
+        split_shares(divisione, extra[node->node_id], node->node_size, node_unsatisfied, void_cells_per_process, node_displacements);
+        for (int i = 0; i < node->node_size; i++)
+            process_counts[i] = void_cells_per_process[i];
+
+        free(shares);
+        free(void_cells_per_node);
+        free(quota);
+        free(extra);
+        free(transfers);
+        free(send_displacements);
+        free(receive_counts);
+        free(receive_displacements);
+    }
+
+    // Ogni nodo divide la propria quota tra i suoi processi
+    MPI_Scatter(process_counts, 1, MPI_INT, number_of_void_cells_to_return, 1, MPI_INT, 0, node->node_comm);
+    voidCell *toReturn = malloc(sizeof(voidCell) * *number_of_void_cells_to_return);
+    scatterv_cells(assigned_void_cells, process_counts, node_displacements, toReturn, *number_of_void_cells_to_return, datatype, 0, node->node_comm);
+
+    free(node_counts);
+    free(node_void_cells);
+    free(node_unsatisfied);
+    free(node_displacements);
+    free(gathered_void_cells);
+    free(assigned_void_cells);
+    free(void_cells_per_process);
+    free(process_counts);
+
     return toReturn;
 }
-/*** Fine funzione per calcolare a quale processo appartiene una determinata roga della matrice ***/
+/*** Fine funzione per assegnare le celle vuote prima tra i nodi e poi tra i processi di ogni nodo ***/
+
+/*** Inizo funzione per calcolare a quale processo appartiene una determinata cella della matrice ***/
+int calculate_source(int world_size, cellIndex *displacement, cellIndex cell) {
+    int first = 0;                  // Primo rank candidato
+    int last = world_size - 1;      // Ultimo rank candidato
+
+    // Ricerca binaria sui displacements (sono crescenti) del processo (rank) a cui appartiene una cella di destinazione
+    while (first < last) {
+        int middle = (first + last + 1) / 2;
+
+        if (cell >= displacement[middle])
+            first = middle;
+        else
+            last = middle - 1;
+    }
+    return first;
+}
+/*** Fine funzione per calcolare a quale processo appartiene una determinata cella della matrice ***/
 
 /*** Inizio funzione per spostare gli agenti ***/
-void move(int rank, int world_size, int original_rows, char *sub_matrix, int *want_move, voidCell *destinations, int num_assigned_void_cells, int *displacements, int *sendcounts, MPI_Datatype move_agent_type) {
+int move(int rank, int world_size, int original_rows, char *sub_matrix, signed char *want_move, voidCell *destinations, int num_assigned_void_cells, cellIndex *displacements, MPI_Datatype move_agent_type, nodeInfo *node, engineConfig *config, pipelineState *pipeline) {
     int num_elems_to_send_to[world_size];      // Array che contiene il numero di moveAgent da mandare al processo i-esimo
     int used_void_cells_assigned = 0;          // Il numero delle celle vuote che sono state assegnate al processo e che ha usato.
     moveAgent **data;                          // Matrice che contiene sulle righe i processi e sulle colonne la cella di destinazione dell'agente che vuole spostarsi
@@ -554,25 +1484,20 @@ void move(int rank, int world_size, int original_rows, char *sub_matrix, int *wa
             // Sposta l'agente in una cella libera
             if (want_move[i * COLUMNS + j] == 1) {                                                                          // Se l'agente vuole spostarsi
                 voidCell destination = destinations[used_void_cells_assigned];                                              // Gli viene assegnata una cella libera
-                int receiver = calculate_source(world_size, displacements, sendcounts, destination.row_index / COLUMNS);    // Si verifica a che processo appartiene la cella di destinazionr
+                int receiver = calculate_source(world_size, displacements, destination.cell_index);                        // Si verifica a che processo appartiene la cella di destinazionr
+                cellIndex destIndex = destination.cell_index - displacements[receiver];                                     // Indice della cella di destinazione nella sottomatrice del destinatario
 
                 // La cella di destinazione appartiene al processo stesso, l'agente viene subito spostato
                 if (receiver == rank) {
-                    int startRow = displacements[rank];                                                 // Riga iniziale
-                    int destRow = destination.row_index - startRow;                                     // Riga di destinazione
-
-                    sub_matrix[destRow + destination.column_index] = sub_matrix[i * COLUMNS + j];       // Sposta l'agente
+                    sub_matrix[destIndex] = sub_matrix[i * COLUMNS + j];                                // Sposta l'agente
                     sub_matrix[i * COLUMNS + j] = EMPTY;                                                // Libera lo spazio nella sottomatrice
 
-                    want_move[destRow + destination.column_index] = 0;                                  // Non rendere più disponibile lo spazio disponibile per altri
+                    want_move[destIndex] = 0;                                                           // Non rendere più disponibile lo spazio disponibile per altri
                     want_move[i * COLUMNS + j] = -1;                                                    // Libera questo spazio precedente
                 }
                 // La cella di destinazione non appartiene al processo stesso
                 else {
-                    int startRow = displacements[receiver];                                             // Riga iniziale del destinatario
-                    int destRow = destination.row_index - startRow;                                     // Riga di destinazione del destinatario
-
-                    moveAgent var = {destRow, destination.column_index, sub_matrix[i * COLUMNS + j]};   // Informazioni e agente che vuole spostarsi
+                    moveAgent var = PACK_AGENT(destIndex, sub_matrix[i * COLUMNS + j]);                 // Cella di destinazione e agente che vuole spostarsi, in una sola parola
                     data[receiver][num_elems_to_send_to[receiver]] = var;                               // Setta al processo 'receiver' la X-esima colonna con la cella di destinazione dell'agente
                     num_elems_to_send_to[receiver] += 1;                                                // Aggiorna il numero di elementi che deve mandare al processo 'receiver'
 
@@ -585,28 +1510,53 @@ void move(int rank, int world_size, int original_rows, char *sub_matrix, int *wa
         }
     }
 
-    // Tutti i processi vengono sincronizzati
-    synchronize(rank, world_size, num_elems_to_send_to, num_assigned_void_cells, data, original_rows, sub_matrix, move_agent_type);
+    // Tutti i processi vengono sincronizzati (con PIPELINE gli agenti partono e arriveranno durante il passo successivo)
+    if (config->pipelined)
+        pipeline_post(rank, world_size, num_elems_to_send_to, data, pipeline);
+    else if (config->migration)
+        synchronize_collective(world_size, num_elems_to_send_to, data, sub_matrix, move_agent_type);
+    else
+        synchronize(rank, world_size, num_elems_to_send_to, num_assigned_void_cells, data, original_rows, sub_matrix, move_agent_type, node, config->compress);
+
+    return used_void_cells_assigned;
 }
 /*** Fine funzione per spostare gli agenti ***/
 
 /*** Inizio funzione per sincronizzare gli postamenti tra i processi ***/
-void synchronize(int rank, int world_size, int *num_elems_to_send_to, int num_assigned_void_cells, moveAgent **data, int original_rows, char *sub_matrix, MPI_Datatype move_agent_type) {
+void synchronize(int rank, int world_size, int *num_elems_to_send_to, int num_assigned_void_cells, moveAgent **data, int original_rows, char *sub_matrix, MPI_Datatype move_agent_type, nodeInfo *node, int compress) {
     int my_void_cell_used_by[world_size];    // Array che contiene in ogni cella il numero di elementi che il processo i-esimo vuole scrivere nelle celle della sottomatrice
     MPI_Request requests1[world_size];       // Array per le prime MPI_Irecv e MPI_Wait
     MPI_Request requests2[world_size];       // Array per le seconde MPI_Irecv e MPI_Wait
+    MPI_Request send_requests1[world_size];  // Array per le prime MPI_Isend (i buffer non possono essere liberati prima della fine dell'invio)
+    MPI_Request send_requests2[world_size];  // Array per le seconde MPI_Isend
     moveAgent **moved_agents;                // Matrice degli agenti che il processo ha ricevuto che deve aggiornare nella sottomatrice
     moveAgent **elements_to_send;            // Array che contiene gli elementi da mandare al processo i-esimo
+    unsigned char **encoded_to_send;         // Elementi compressi da mandare al processo i-esimo (NULL se il messaggio non è compresso)
+    unsigned char **encoded_received;        // Elementi compressi ricevuti dal processo i-esimo (NULL se il messaggio non è compresso)
+    MPI_Comm comm[world_size];               // Comunicatore usato con il processo i-esimo (quello del nodo se si trova sullo stesso nodo)
+    int peer[world_size];                    // Rank del processo i-esimo nel comunicatore usato
+
+    moved_agents = (moveAgent **)calloc(world_size, sizeof(moveAgent *));
+    elements_to_send = (moveAgent **)calloc(world_size, sizeof(moveAgent *));
+    encoded_to_send = (unsigned char **)calloc(world_size, sizeof(unsigned char *));
+    encoded_received = (unsigned char **)calloc(world_size, sizeof(unsigned char *));
 
-    moved_agents = (moveAgent **)malloc(sizeof(moveAgent *) * world_size - 1);
-    elements_to_send = (moveAgent **)malloc(sizeof(moveAgent *) * world_size - 1);
+    // Gli spostamenti che restano nello stesso nodo passano per il comunicatore del nodo
+    for (int i = 0; i < world_size; i++) {
+        int local = node != NULL ? node->world_to_node[i] : MPI_UNDEFINED;
+        comm[i] = local != MPI_UNDEFINED ? node->node_comm : MPI_COMM_WORLD;
+        peer[i] = local != MPI_UNDEFINED ? local : i;
+    }
 
     // Vengono calcolate quante celle sono state usate dei num_elems_to_send_to
     for (int i = 0; i < world_size; i++) {
-        if (i == rank) continue;
+        if (i == rank) {
+            send_requests1[i] = send_requests2[i] = MPI_REQUEST_NULL;
+            continue;
+        }
 
-        MPI_Isend(&num_elems_to_send_to[i], 1, MPI_INT, i, 99, MPI_COMM_WORLD, &requests1[i]);  // Manda al processo i il numero di celle che ha usato
-        MPI_Irecv(&my_void_cell_used_by[i], 1, MPI_INT, i, 99, MPI_COMM_WORLD, &requests1[i]);  // Riceve dal processo i il numero di celle del processo che lui ha usato
+        MPI_Isend(&num_elems_to_send_to[i], 1, MPI_INT, peer[i], 99, comm[i], &send_requests1[i]);  // Manda al processo i il numero di celle che ha usato
+        MPI_Irecv(&my_void_cell_used_by[i], 1, MPI_INT, peer[i], 99, comm[i], &requests1[i]);       // Riceve dal processo i il numero di celle del processo che lui ha usato
     }
 
     // Manda/riceve al/dal processo i-esimo tutte le celle di destinazione dove deve scrivere/salvare i suoi agenti
@@ -623,9 +1573,20 @@ void synchronize(int rank, int world_size, int *num_elems_to_send_to, int num_as
 
         MPI_Wait(&requests1[i], NULL);  // Aspetta che la prima Irecv riceva il numero di elementi che gli altri processi vogliono scrivere nelle sue celle della sottomatrice
 
+        // Sia chi manda sia chi riceve conosce il numero di elementi, quindi entrambi sanno se il messaggio è compresso
+        if (compress && ENCODABLE(number_of_elems_to_send) && number_of_elems_to_send * sizeof(moveAgent) > COMPRESS_THRESHOLD) {
+            encoded_to_send[i] = malloc(MAX_ENCODED_SIZE(number_of_elems_to_send));
+            int bytes = encode_moved_agents(elements_to_send[i], number_of_elems_to_send, encoded_to_send[i]);
+            MPI_Isend(encoded_to_send[i], bytes, MPI_BYTE, peer[i], 100, comm[i], &send_requests2[i]);
+        } else
+            MPI_Isend(elements_to_send[i], number_of_elems_to_send, move_agent_type, peer[i], 100, comm[i], &send_requests2[i]);
+
         moved_agents[i] = (moveAgent *)malloc(my_void_cell_used_by[i] * sizeof(moveAgent));
-        MPI_Isend(elements_to_send[i], number_of_elems_to_send, move_agent_type, i, 100, MPI_COMM_WORLD, &requests2[i]);
-        MPI_Irecv(moved_agents[i], my_void_cell_used_by[i], move_agent_type, i, 100, MPI_COMM_WORLD, &requests2[i]);
+        if (compress && ENCODABLE(my_void_cell_used_by[i]) && my_void_cell_used_by[i] * sizeof(moveAgent) > COMPRESS_THRESHOLD) {
+            encoded_received[i] = malloc(MAX_ENCODED_SIZE(my_void_cell_used_by[i]));
+            MPI_Irecv(encoded_received[i], MAX_ENCODED_SIZE(my_void_cell_used_by[i]), MPI_BYTE, peer[i], 100, comm[i], &requests2[i]);
+        } else
+            MPI_Irecv(moved_agents[i], my_void_cell_used_by[i], move_agent_type, peer[i], 100, comm[i], &requests2[i]);
     }
 
     // Aspetta che le seconde MPI_Wait terminino
@@ -633,6 +1594,8 @@ void synchronize(int rank, int world_size, int *num_elems_to_send_to, int num_as
         if (i == rank) continue;
 
         MPI_Wait(&requests2[i], NULL);
+        if (encoded_received[i] != NULL)
+            decode_moved_agents(encoded_received[i], my_void_cell_used_by[i], moved_agents[i]);
     }
 
     // Scrive gli agenti 'nuovi' nelle celle di destinazione
@@ -640,80 +1603,443 @@ void synchronize(int rank, int world_size, int *num_elems_to_send_to, int num_as
         if (i == rank) continue;
 
         for (int k = 0; k < my_void_cell_used_by[i]; k++)
-            sub_matrix[moved_agents[i][k].destination_row + moved_agents[i][k].destination_column] = moved_agents[i][k].agent;  // Scrive l'agente nella cella vuota
+            sub_matrix[AGENT_INDEX(moved_agents[i][k])] = AGENT_TYPE(moved_agents[i][k]);  // Scrive l'agente nella cella vuota
     }
 
+    // Prima di deallocare i buffer gli invii devono essere terminati
+    MPI_Waitall(world_size, send_requests1, MPI_STATUSES_IGNORE);
+    MPI_Waitall(world_size, send_requests2, MPI_STATUSES_IGNORE);
+
     // Dealloca
     for (int i = 0; i < world_size; i++) {
         free(data[i]);
-        if (i == rank) continue;
-
         free(moved_agents[i]);
+        free(elements_to_send[i]);
+        free(encoded_to_send[i]);
+        free(encoded_received[i]);
     }
     free(data);
     free(moved_agents);
     free(elements_to_send);
+    free(encoded_to_send);
+    free(encoded_received);
 }
 /*** Fine funzioe per sincronizzare gli spostamenti tra i processi ***/
 
+/*** Inizio funzione per sincronizzare gli spostamenti tra i processi con una comunicazione collettiva ***/
+void synchronize_collective(int world_size, int *num_elems_to_send_to, moveAgent **data, char *sub_matrix, MPI_Datatype move_agent_type) {
+    int my_void_cell_used_by[world_size];    // Numero di agenti che il processo i-esimo scrive nella sottomatrice
+    int send_displacements[world_size];      // Displacements degli agenti da mandare
+    int receive_displacements[world_size];   // Displacements degli agenti ricevuti
+
+    // Una sola comunicazione collettiva per i conteggi e una per gli agenti, invece di due messaggi per ogni coppia di processi
+    MPI_Alltoall(num_elems_to_send_to, 1, MPI_INT, my_void_cell_used_by, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (int i = 0; i < world_size; i++) {
+        send_displacements[i] = i == 0 ? 0 : send_displacements[i - 1] + num_elems_to_send_to[i - 1];
+        receive_displacements[i] = i == 0 ? 0 : receive_displacements[i - 1] + my_void_cell_used_by[i - 1];
+    }
+
+    int number_of_elems_to_send = send_displacements[world_size - 1] + num_elems_to_send_to[world_size - 1];
+    int number_of_elems_received = receive_displacements[world_size - 1] + my_void_cell_used_by[world_size - 1];
+    moveAgent *elements_to_send = malloc(number_of_elems_to_send * sizeof(moveAgent));
+    moveAgent *moved_agents = malloc(number_of_elems_received * sizeof(moveAgent));
+
+    for (int i = 0; i < world_size; i++)
+        memcpy(elements_to_send + send_displacements[i], data[i], num_elems_to_send_to[i] * sizeof(moveAgent));
+
+    MPI_Alltoallv(elements_to_send, num_elems_to_send_to, send_displacements, move_agent_type, moved_agents, my_void_cell_used_by, receive_displacements, move_agent_type, MPI_COMM_WORLD);
+
+    // Scrive gli agenti 'nuovi' nelle celle di destinazione
+    for (int k = 0; k < number_of_elems_received; k++)
+        sub_matrix[AGENT_INDEX(moved_agents[k])] = AGENT_TYPE(moved_agents[k]);
+
+    // Dealloca
+    for (int i = 0; i < world_size; i++)
+        free(data[i]);
+    free(data);
+    free(elements_to_send);
+    free(moved_agents);
+}
+/*** Fine funzione per sincronizzare gli spostamenti tra i processi con una comunicazione collettiva ***/
+
+/*** Inizio funzione per preparare lo stato degli arrivi in volo ***/
+void pipeline_init(int world_size, cellIndex *displacements, cellIndex *sendcounts, MPI_Datatype move_agent_type, pipelineState *pipeline) {
+    pipeline->displacements = displacements;
+    pipeline->sendcounts = sendcounts;
+    pipeline->move_agent_type = move_agent_type;
+    pipeline->arrivals_from = calloc(world_size, sizeof(int));
+    pipeline->departures_to = calloc(world_size, sizeof(int));
+    pipeline->pending = NULL;
+    pipeline->number_of_pending = 0;
+    pipeline->mask = NULL;
+    pipeline->deferred_cells = NULL;
+    pipeline->number_of_deferred = 0;
+    pipeline->deferred_capacity = 0;
+    pipeline->arrivals = NULL;
+    pipeline->departures = NULL;
+    pipeline->requests = malloc(2 * world_size * sizeof(MPI_Request));
+    pipeline->in_flight = 0;
+}
+/*** Fine funzione per preparare lo stato degli arrivi in volo ***/
+
+/*** Inizio funzione per liberare lo stato degli arrivi in volo ***/
+void pipeline_free(pipelineState *pipeline) {
+    free(pipeline->arrivals_from);
+    free(pipeline->departures_to);
+    free(pipeline->pending);
+    free(pipeline->mask);
+    free(pipeline->deferred_cells);
+    free(pipeline->requests);
+}
+/*** Fine funzione per liberare lo stato degli arrivi in volo ***/
+
+/*** Inizio funzione per segnare le celle che dipendono dagli arrivi o dalle righe dei vicini ***/
+signed char *defer_pending_cells(int rank, int world_size, int original_rows, pipelineState *pipeline) {
+    int most_deferred = 2 * COLUMNS + 9 * pipeline->number_of_pending;    // Celle rimandate al massimo: prima e ultima riga e finestre delle celle in pending
+
+    // La maschera viene allocata una sola volta: le celle già calcolate contengono lo stato del passo precedente (-1, 0 o 1), che vale come "pronta",
+    // e le celle segnate DEFERRED_CELL vengono sempre sovrascritte entro la fine del passo
+    if (pipeline->mask == NULL)
+        pipeline->mask = calloc(original_rows * COLUMNS, sizeof(signed char));
+    if (most_deferred > original_rows * COLUMNS)
+        most_deferred = original_rows * COLUMNS;
+    if (most_deferred > pipeline->deferred_capacity) {
+        pipeline->deferred_capacity = most_deferred;
+        pipeline->deferred_cells = realloc(pipeline->deferred_cells, most_deferred * sizeof(int));
+    }
+
+    signed char *mat = pipeline->mask;    // DEFERRED_CELL per le celle da calcolare dopo gli arrivi
+
+    // La prima e l'ultima riga leggono le righe dei vicini, che possono ancora ricevere agenti
+    if (rank != 0)
+        memset(mat, DEFERRED_CELL, COLUMNS);
+    if (rank != world_size - 1)
+        memset(mat + (original_rows - 1) * COLUMNS, DEFERRED_CELL, COLUMNS);
+
+    // Una cella che può ricevere un agente cambia la finestra 3x3 di tutte le celle intorno
+    for (int p = 0; p < pipeline->number_of_pending; p++) {
+        int row = pipeline->pending[p] / COLUMNS;
+        int column = pipeline->pending[p] % COLUMNS;
+
+        for (int i = row > 0 ? row - 1 : row; i <= row + 1 && i < original_rows; i++)
+            for (int j = column > 0 ? column - 1 : column; j <= column + 1 && j < COLUMNS; j++)
+                mat[i * COLUMNS + j] = DEFERRED_CELL;
+    }
+
+    return mat;
+}
+/*** Fine funzione per segnare le celle che dipendono dagli arrivi o dalle righe dei vicini ***/
+
+/*** Inizio funzione per calcolare le celle pronte (o quelle rimandate) ***/
+void calculate_pipelined_cells(int rank, int world_size, int original_rows, int total_rows, char *sub_matrix, cellIndex displacement, pipelineState *pipeline, int deferred, int *unsatisfied_agents, long long *similar_neighbours, voidCell *void_cells, int *number_of_void_cells) {
+    signed char *mat = pipeline->mask;
+    int ind = 0;    // Numero di celle vuote trovate
+
+    // Posizione delle righe dei processi adiacenti (come in calculate_move_and_void_cells)
+    char *ngh_precedent_row = NULL;
+    char *ngh_next_row = NULL;
+    if (rank != 0)
+        ngh_precedent_row = sub_matrix + (total_rows - ((rank == world_size - 1) ? 1 : 2)) * COLUMNS;
+    if (rank != world_size - 1)
+        ngh_next_row = sub_matrix + (total_rows - 1) * COLUMNS;
+
+    // Nella prima passata tutta la sottomatrice: le celle pronte vengono calcolate e quelle rimandate elencate (già in ordine)
+    if (!deferred) {
+        pipeline->number_of_deferred = 0;
+        for (int i = 0; i < original_rows; i++) {
+            char *row = sub_matrix + i * COLUMNS;
+            char *up = i != 0 ? row - COLUMNS : ngh_precedent_row;
+            char *down = i != original_rows - 1 ? row + COLUMNS : ngh_next_row;
+
+            for (int j = 0; j < COLUMNS; j++) {
+                if (mat[i * COLUMNS + j] == DEFERRED_CELL) {
+                    pipeline->deferred_cells[pipeline->number_of_deferred++] = i * COLUMNS + j;
+                    continue;
+                }
+
+                int state = classify_cell(row, up, down, j, similar_neighbours);
+
+                mat[i * COLUMNS + j] = state;
+                if (state == -1) {
+                    voidCell temp = {displacement + i * COLUMNS + j};
+                    void_cells[ind++] = temp;
+                } else
+                    *unsatisfied_agents += state;
+            }
+        }
+    } else
+        // Nella seconda passata solo le celle elencate
+        for (int k = 0; k < pipeline->number_of_deferred; k++) {
+            int i = pipeline->deferred_cells[k] / COLUMNS;
+            int j = pipeline->deferred_cells[k] % COLUMNS;
+            char *row = sub_matrix + i * COLUMNS;
+            char *up = i != 0 ? row - COLUMNS : ngh_precedent_row;
+            char *down = i != original_rows - 1 ? row + COLUMNS : ngh_next_row;
+            int state = classify_cell(row, up, down, j, similar_neighbours);
+
+            mat[i * COLUMNS + j] = state;
+            if (state == -1) {
+                voidCell temp = {displacement + i * COLUMNS + j};
+                void_cells[ind++] = temp;
+            } else
+                *unsatisfied_agents += state;
+        }
+
+    *number_of_void_cells += ind;
+}
+/*** Fine funzione per calcolare le celle pronte (o quelle rimandate) ***/
+
+/*** Inizio funzione per unire due array ordinati di celle vuote ***/
+void merge_void_cells(voidCell *into, int number_of_into, voidCell *other, int number_of_other) {
+    int i = number_of_into - 1, j = number_of_other - 1;
+
+    // Si riempie into dal fondo (ha spazio per entrambi), così non serve un terzo array
+    for (int k = number_of_into + number_of_other - 1; j >= 0; k--)
+        into[k] = (i >= 0 && into[i].cell_index > other[j].cell_index) ? into[i--] : other[j--];
+}
+/*** Fine funzione per unire due array ordinati di celle vuote ***/
+
+/*** Inizio funzione per inviare gli agenti senza aspettarne l'arrivo ***/
+void pipeline_post(int rank, int world_size, int *num_elems_to_send_to, moveAgent **data, pipelineState *pipeline) {
+    int number_of_arrivals = 0;
+
+    for (int i = 0; i < world_size; i++)
+        number_of_arrivals += pipeline->arrivals_from[i];
+    pipeline->arrivals = malloc(number_of_arrivals * sizeof(moveAgent));
+
+    // Chi riceve conosce al massimo quanti agenti arrivano, quindi non serve scambiarsi i conteggi
+    number_of_arrivals = 0;
+    for (int i = 0; i < world_size; i++) {
+        pipeline->requests[i] = pipeline->requests[world_size + i] = MPI_REQUEST_NULL;
+        if (i == rank) continue;
+
+        if (pipeline->arrivals_from[i] > 0)
+            MPI_Irecv(pipeline->arrivals + number_of_arrivals, pipeline->arrivals_from[i], pipeline->move_agent_type, i, PIPELINE_TAG, MPI_COMM_WORLD, &pipeline->requests[i]);
+        if (pipeline->departures_to[i] > 0)
+            MPI_Isend(data[i], num_elems_to_send_to[i], pipeline->move_agent_type, i, PIPELINE_TAG, MPI_COMM_WORLD, &pipeline->requests[world_size + i]);
+        number_of_arrivals += pipeline->arrivals_from[i];
+    }
+
+    pipeline->departures = data;
+    pipeline->in_flight = 1;
+}
+/*** Fine funzione per inviare gli agenti senza aspettarne l'arrivo ***/
+
+/*** Inizio funzione per completare gli arrivi in volo ***/
+void pipeline_complete(int world_size, char *sub_matrix, pipelineState *pipeline) {
+    MPI_Status statuses[world_size];
+    int displacement = 0;
+
+    if (!pipeline->in_flight)
+        return;
+
+    MPI_Waitall(world_size, pipeline->requests, statuses);
+
+    // Scrive gli agenti arrivati nelle celle di destinazione
+    for (int i = 0; i < world_size; i++) {
+        if (pipeline->arrivals_from[i] == 0) continue;
+
+        int count;
+        MPI_Get_count(&statuses[i], pipeline->move_agent_type, &count);
+        for (int k = displacement; k < displacement + count; k++)
+            sub_matrix[AGENT_INDEX(pipeline->arrivals[k])] = AGENT_TYPE(pipeline->arrivals[k]);
+        displacement += pipeline->arrivals_from[i];
+    }
+
+    // Prima di deallocare i buffer gli invii devono essere terminati
+    MPI_Waitall(world_size, pipeline->requests + world_size, MPI_STATUSES_IGNORE);
+    for (int i = 0; i < world_size; i++)
+        free(pipeline->departures[i]);
+    free(pipeline->departures);
+    free(pipeline->arrivals);
+    pipeline->departures = NULL;
+    pipeline->arrivals = NULL;
+    pipeline->in_flight = 0;
+}
+/*** Fine funzione per completare gli arrivi in volo ***/
+
+/*** Inizio funzione per comprimere un array di celle vuote ***/
+int encode_void_cells(voidCell *void_cells, int count, unsigned char *buffer) {
+    unsigned long long previous = 0;    // Indice della cella precedente
+    int bytes = 0;                      // Byte scritti
+
+    // Si scrive la differenza tra indici consecutivi in varint (7 bit per byte, il bit più alto indica che il numero continua).
+    // Con le celle ordinate le differenze sono piccole; l'aritmetica senza segno rende la codifica corretta anche se non lo sono
+    for (int i = 0; i < count; i++) {
+        unsigned long long delta = (unsigned long long)void_cells[i].cell_index - previous;
+        previous = (unsigned long long)void_cells[i].cell_index;
+
+        while (delta >= 0x80) {
+            buffer[bytes++] = (unsigned char)(delta | 0x80);
+            delta >>= 7;
+        }
+        buffer[bytes++] = (unsigned char)delta;
+    }
+
+    return bytes;
+}
+/*** Fine funzione per comprimere un array di celle vuote ***/
+
+/*** Inizio funzione per decomprimere un array di celle vuote ***/
+void decode_void_cells(unsigned char *buffer, int count, voidCell *void_cells) {
+    unsigned long long previous = 0;    // Indice della cella precedente
+
+    for (int i = 0; i < count; i++) {
+        unsigned long long delta = 0;
+        int shift = 0;
+
+        do {
+            delta |= (unsigned long long)(*buffer & 0x7F) << shift;
+            shift += 7;
+        } while (*buffer++ & 0x80);
+
+        previous += delta;
+        void_cells[i].cell_index = (cellIndex)previous;
+    }
+}
+/*** Fine funzione per decomprimere un array di celle vuote ***/
+
+/*** Inizio funzione per ordinare e comprimere un array di agenti da spostare ***/
+int encode_moved_agents(moveAgent *agents, int count, unsigned char *buffer) {
+    unsigned long long previous = 0;    // Indice della cella precedente
+    int bytes = 0;                      // Byte scritti
+
+    // L'ordine di scrittura nella sottomatrice non conta, quindi gli agenti vengono ordinati per cella di destinazione
+    qsort(agents, count, sizeof(moveAgent), compare_moved_agents);
+
+    // Indici delle celle di destinazione in varint (come in encode_void_cells)
+    for (int i = 0; i < count; i++) {
+        unsigned long long delta = (unsigned long long)AGENT_INDEX(agents[i]) - previous;
+        previous = (unsigned long long)AGENT_INDEX(agents[i]);
+
+        while (delta >= 0x80) {
+            buffer[bytes++] = (unsigned char)(delta | 0x80);
+            delta >>= 7;
+        }
+        buffer[bytes++] = (unsigned char)delta;
+    }
+
+    // Tipi degli agenti in una bitmap (1: 'X', 0: 'O')
+    memset(buffer + bytes, 0, (count + 7) / 8);
+    for (int i = 0; i < count; i++)
+        buffer[bytes + i / 8] |= (agents[i] & 1) << (i % 8);
+
+    return bytes + (count + 7) / 8;
+}
+/*** Fine funzione per ordinare e comprimere un array di agenti da spostare ***/
+
+/*** Inizio funzione per decomprimere un array di agenti da spostare ***/
+void decode_moved_agents(unsigned char *buffer, int count, moveAgent *agents) {
+    unsigned long long previous = 0;    // Indice della cella precedente
+
+    for (int i = 0; i < count; i++) {
+        unsigned long long delta = 0;
+        int shift = 0;
+
+        do {
+            delta |= (unsigned long long)(*buffer & 0x7F) << shift;
+            shift += 7;
+        } while (*buffer++ & 0x80);
+
+        previous += delta;
+        agents[i] = (moveAgent)previous << 1;
+    }
+
+    // Dopo gli indici c'è la bitmap dei tipi
+    for (int i = 0; i < count; i++)
+        agents[i] |= (buffer[i / 8] >> (i % 8)) & 1;
+}
+/*** Fine funzione per decomprimere un array di agenti da spostare ***/
+
+/*** Inizio funzioni per ordinare celle vuote e agenti (qsort) ***/
+int compare_void_cells(const void *a, const void *b) {
+    cellIndex first = ((const voidCell *)a)->cell_index;
+    cellIndex second = ((const voidCell *)b)->cell_index;
+
+    return (first > second) - (first < second);
+}
+
+int compare_moved_agents(const void *a, const void *b) {
+    moveAgent first = *(const moveAgent *)a;
+    moveAgent second = *(const moveAgent *)b;
+
+    return (first > second) - (first < second);
+}
+/*** Fine funzioni per ordinare celle vuote e agenti (qsort) ***/
+
+/*** Inizio funzione per raggruppare i processi per nodo ***/
+void define_node_info(int rank, int world_size, nodeInfo *node) {
+    MPI_Group world_group, node_group;
+    int world_ranks[world_size];
+
+    // Processi che possono condividere memoria (stesso nodo)
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node->node_comm);
+    MPI_Comm_rank(node->node_comm, &node->node_rank);
+    MPI_Comm_size(node->node_comm, &node->node_size);
+
+    // Il processo con rank 0 nel nodo fa da leader
+    MPI_Comm_split(MPI_COMM_WORLD, node->node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &node->leader_comm);
+    if (node->node_rank == 0) {
+        MPI_Comm_rank(node->leader_comm, &node->node_id);
+        MPI_Comm_size(node->leader_comm, &node->number_of_nodes);
+    }
+    MPI_Bcast(&node->node_id, 1, MPI_INT, 0, node->node_comm);
+    MPI_Bcast(&node->number_of_nodes, 1, MPI_INT, 0, node->node_comm);
+
+    // Traduzione dei rank del mondo nei rank del nodo
+    for (int i = 0; i < world_size; i++)
+        world_ranks[i] = i;
+    node->world_to_node = malloc(world_size * sizeof(int));
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(node->node_comm, &node_group);
+    MPI_Group_translate_ranks(world_group, world_size, world_ranks, node_group, node->world_to_node);
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&node_group);
+}
+/*** Fine funzione per raggruppare i processi per nodo ***/
+
+/*** Inizio funzione per liberare i comunicatori dei nodi ***/
+void free_node_info(nodeInfo *node) {
+    if (node->leader_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&node->leader_comm);
+    MPI_Comm_free(&node->node_comm);
+    free(node->world_to_node);
+}
+/*** Fine funzione per liberare i comunicatori dei nodi ***/
+
 /*** Inizio funzione per definire il tipo voidCell ***/
 void define_voidCell_type(MPI_Datatype *VOID_CELL_TYPE) {
-    int vc_items = 2;                   // Numero di items
-    int vc_block_length[2] = {1, 1};    // Lunghezza dei blocchi
-
-    MPI_Aint vc_offsets[2];    // Definisce il tipo di una variabile che contiene un indirizzo di memoria
-    voidCell void_cell;        // Di tipo void_cell
-    MPI_Aint vc_base_address;
-    MPI_Get_address(&void_cell, &vc_base_address);      // Restituisce l'indirizzo di una locazione in memoria (location, addres)
-    MPI_Get_address(&void_cell.row_index, &vc_offsets[0]);
-    MPI_Get_address(&void_cell.column_index, &vc_offsets[1]);
-    vc_offsets[0] = MPI_Aint_diff(vc_offsets[0], vc_base_address);   // Calcola l'offset fscendo la differenza tra due indirizzi
-    vc_offsets[1] = MPI_Aint_diff(vc_offsets[1], vc_base_address);
-
-    MPI_Datatype vc_types[2] = {MPI_INT, MPI_INT};
-    MPI_Type_create_struct(vc_items, vc_block_length, vc_offsets, vc_types, VOID_CELL_TYPE);   // Crea un MPI datatype (numero di blocchi da creare, array che contiene la lunghezza di ogni blocco, displacment per ogni blocco, array che contiene l'MPI datatype da replicare per ogni blocco, variabile in cui mettere il nuovo datatype)
-    MPI_Type_commit(VOID_CELL_TYPE);            // Commit del tipo
+    // Una cella vuota è solo il suo indice lineare globale
+    MPI_Type_contiguous(1, MPI_CELL_INDEX, VOID_CELL_TYPE);    // (numero di elementi, tipo degli elementi, variabile in cui mettere il nuovo datatype)
+    MPI_Type_commit(VOID_CELL_TYPE);                           // Commit del tipo
 }
 /*** Fine funzie per definire il tipo voidCell ***/
 
 /*** Inizio funzione per definire il tipo moveAgent ***/
 void define_moveAgent_type(MPI_Datatype *MOVE_AGENT_TYPE) {
-    int ma_items = 3;                    // Numero di items
-    int ma_block_length[3] = {1, 1, 1};  // Lunghezza dei blocchi
-
-    MPI_Aint ma_offsets[3];      // Definisce il tipo di una variabile che contiene un indirizzo di memoria
-    moveAgent move_agent;        // Di tipo move_agent
-    MPI_Aint ma_base_address;
-    MPI_Get_address(&move_agent, &ma_base_address);     // Restituisce l'indirizzo di una locazione in memoria (location, addres)
-    MPI_Get_address(&move_agent.destination_row, &ma_offsets[0]);
-    MPI_Get_address(&move_agent.destination_column, &ma_offsets[1]);
-    MPI_Get_address(&move_agent.agent, &ma_offsets[2]);
-    ma_offsets[0] = MPI_Aint_diff(ma_offsets[0], ma_base_address);    // Calcola l'offset fscendo la differenza tra due indirizzi
-    ma_offsets[1] = MPI_Aint_diff(ma_offsets[1], ma_base_address);
-    ma_offsets[2] = MPI_Aint_diff(ma_offsets[2], ma_base_address);
-
-    MPI_Datatype ma_types[3] = {MPI_INT, MPI_INT, MPI_CHAR};
-    MPI_Type_create_struct(ma_items, ma_block_length, ma_offsets, ma_types, MOVE_AGENT_TYPE);    // Crea un MPI datatype (numero di blocchi da creare, array che contiene la lunghezza di ogni blocco, displacment per ogni blocco, array che contiene l'MPI datatype da replicare per ogni blocco, variabile in cui mettere il nuovo datatype)
-    MPI_Type_commit(MOVE_AGENT_TYPE);                       // Commit del tipo
+    // Indice della cella di destinazione e tipo dell'agente viaggiano in una sola parola (4 o 8 byte invece di una struttura di 12 byte)
+    MPI_Type_contiguous(1, MPI_PACKED_AGENT, MOVE_AGENT_TYPE);
+    MPI_Type_commit(MOVE_AGENT_TYPE);                          // Commit del tipo
 }
 /*** Fine funzioe per definire il tipo moveAgent ***/
 
 /*** Inizio funzione per calcolare la soddisfazione finale di tutti gli agenti ***/
 void calculate_total_satisfaction(int rank, int world_size, char *matrix) {
-    int total_agents = 0;                                                                 // Agenti totali
-    int satisfied_agents = 0;                                                             // Agenti non soddisfatti
-    moveAgent *not_satisfied_agents = malloc(ROWS * COLUMNS * sizeof(moveAgent));         // Agenti soddisfatti
+    long long total_agents = 0;                                                           // Agenti totali
+    long long satisfied_agents = 0;                                                       // Agenti non soddisfatti
+    moveAgent *not_satisfied_agents = malloc((size_t)ROWS * COLUMNS * sizeof(moveAgent)); // Agenti soddisfatti
 
-    int index = 0;
+    long long index = 0;
 
     for (int i = 0; i < ROWS; i++)
         for (int j = 0; j < COLUMNS; j++)
-            if (matrix[i * COLUMNS + j] != EMPTY) {
+            if (matrix[(cellIndex)i * COLUMNS + j] != EMPTY) {
                 total_agents++;
-                if (is_satisfied(rank, world_size, ROWS, ROWS, i * COLUMNS, j, matrix)) {
+                if (is_satisfied(rank, world_size, ROWS, ROWS, (cellIndex)i * COLUMNS, j, matrix, NULL)) {
                     satisfied_agents++;
                 } else {
-                    moveAgent var = {i * COLUMNS, j, matrix[i * COLUMNS + j]};
+                    moveAgent var = PACK_AGENT((cellIndex)i * COLUMNS + j, matrix[(cellIndex)i * COLUMNS + j]);
                     not_satisfied_agents[index] = var;
                     index++;
                 }
@@ -722,10 +2048,10 @@ void calculate_total_satisfaction(int rank, int world_size, char *matrix) {
     // Rapporto tra agenti soddisfatti e insodisfatti
     float average = ((double)satisfied_agents / (double)total_agents) * 100;
     printf("\nInfo:\n");
-    printf("- Agenti totali: %d\n", total_agents);
-    printf("- Agenti soddisfatti: %d\n", satisfied_agents);
+    printf("- Agenti totali: %lld\n", total_agents);
+    printf("- Agenti soddisfatti: %lld\n", satisfied_agents);
     if (index != 0) {
-        printf("- Agenti non soddisfatti: %d\n", index);
+        printf("- Agenti non soddisfatti: %lld\n", index);
     }
     printf("Percentuale di soddisfazione: %.3f%%\n", average);
 
@@ -733,16 +2059,293 @@ void calculate_total_satisfaction(int rank, int world_size, char *matrix) {
 }
 /*** Fine funzione per calcolare la soddisfazione finale di tutti gli agenti ***/
 
+/*** Inizio funzione per calcolare l'hash della sottomatrice ***/
+unsigned long long hash_sub_matrix(int original_rows, char *sub_matrix, cellIndex displacement) {
+    unsigned long long hash = 0;    // Somma degli hash delle celle, non dipende dall'ordine e quindi dalla suddivisione tra i processi
+
+    // Le celle vuote non contribuiscono, ogni agente viene identificato dalla sua posizione globale e dal suo tipo
+    for (int i = 0; i < original_rows * COLUMNS; i++) {
+        if (sub_matrix[i] == EMPTY)
+            continue;
+
+        hash += splitmix64(((unsigned long long)(displacement + i) << 1) | (sub_matrix[i] == AGENT_X));
+    }
+
+    return hash;
+}
+/*** Fine funzione per calcolare l'hash della sottomatrice ***/
+
+/*** Inizio funzione per mescolare i bit di una chiave a 64 bit (splitmix64) ***/
+unsigned long long splitmix64(unsigned long long key) {
+    key += 0x9E3779B97F4A7C15ULL;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    return key ^ (key >> 31);
+}
+/*** Fine funzione per mescolare i bit di una chiave a 64 bit (splitmix64) ***/
+
+/*** Inizio funzione per preparare la verifica ***/
+int verify_init(int rank, int world_size, verifyTrace *trace) {
+    int header[2] = {0, 0};                     // Numero di passi e presenza degli hash per rank, condivisi dal MASTER
+    unsigned long long *all_local = NULL;       // Hash attesi di tutti i rank (solo MASTER), ordinati per rank
+
+    trace->file = NULL;
+    trace->steps = 0;
+    trace->per_rank = 0;
+    trace->diverged_step = -1;
+    trace->expected = NULL;
+    trace->expected_local = NULL;
+
+    // Registrazione: solo il MASTER scrive la traccia
+    if (VERIFY == 1) {
+        if (rank == MASTER) {
+            trace->file = fopen(VERIFY_TRACE, "w");
+            if (trace->file == NULL) {
+                printf("\033[1;31mERRORE\033[0m! Impossibile creare la traccia %s.\n\n", VERIFY_TRACE);
+                return 0;
+            }
+            fprintf(trace->file, "%d %d %d %d\n", ROWS, COLUMNS, world_size, MAX_STEP);
+        }
+        return 1;
+    }
+
+    // Confronto: il MASTER legge la traccia di riferimento e la distribuisce
+    if (rank == MASTER) {
+        int rows, columns, trace_world_size, steps;
+        FILE *file = fopen(VERIFY_TRACE, "r");
+
+        if (file == NULL || fscanf(file, "%d %d %d %d", &rows, &columns, &trace_world_size, &steps) != 4) {
+            printf("\033[1;31mERRORE\033[0m! Impossibile leggere la traccia %s.\n\n", VERIFY_TRACE);
+            if (file != NULL)
+                fclose(file);
+            return 0;
+        }
+        if (rows != ROWS || columns != COLUMNS) {
+            printf("\033[1;31mERRORE\033[0m! La traccia è stata registrata con una matrice %d * %d.\n\n", rows, columns);
+            fclose(file);
+            return 0;
+        }
+
+        // Gli hash dei singoli rank sono confrontabili solo con lo stesso numero di processi
+        header[0] = steps < MAX_STEP ? steps : MAX_STEP;
+        header[1] = trace_world_size == world_size;
+        trace->expected = malloc((header[0] + 1) * 3 * sizeof(unsigned long long));
+        all_local = malloc((header[0] + 1) * world_size * sizeof(unsigned long long));
+
+        for (int i = 0; i <= header[0]; i++) {
+            int step;
+            if (fscanf(file, "%d %llu %llu %llu", &step, &trace->expected[i * 3], &trace->expected[i * 3 + 1], &trace->expected[i * 3 + 2]) != 4) {
+                printf("\033[1;31mERRORE\033[0m! Traccia %s incompleta al passo %d.\n\n", VERIFY_TRACE, i);
+                fclose(file);
+                free(all_local);
+                return 0;
+            }
+            for (int r = 0; r < trace_world_size; r++) {
+                unsigned long long hash;
+                if (fscanf(file, "%llu", &hash) == 1 && header[1])
+                    all_local[r * (header[0] + 1) + i] = hash;
+            }
+        }
+        fclose(file);
+
+        if (!header[1])
+            printf("La traccia è stata registrata con %d processi: verrà indicato solo il passo di divergenza.\n", trace_world_size);
+    }
+
+    MPI_Bcast(header, 2, MPI_INT, MASTER, MPI_COMM_WORLD);
+    trace->steps = header[0];
+    trace->per_rank = header[1];
+
+    if (rank != MASTER)
+        trace->expected = malloc((trace->steps + 1) * 3 * sizeof(unsigned long long));
+    MPI_Bcast(trace->expected, (trace->steps + 1) * 3, MPI_UNSIGNED_LONG_LONG, MASTER, MPI_COMM_WORLD);
+
+    // Ogni processo riceve solo gli hash attesi per la propria sottomatrice
+    if (trace->per_rank) {
+        trace->expected_local = malloc((trace->steps + 1) * sizeof(unsigned long long));
+        MPI_Scatter(all_local, trace->steps + 1, MPI_UNSIGNED_LONG_LONG, trace->expected_local, trace->steps + 1, MPI_UNSIGNED_LONG_LONG, MASTER, MPI_COMM_WORLD);
+    }
+
+    free(all_local);
+    return 1;
+}
+/*** Fine funzione per preparare la verifica ***/
+
+/*** Inizio funzione per registrare o confrontare lo stato di un passo ***/
+void verify_step(int rank, int world_size, int step, unsigned long long local_hash, int unsatisfied_agents, int moved_agents, verifyTrace *trace) {
+    unsigned long long local[3] = {local_hash, unsatisfied_agents, moved_agents};    // Valori del processo
+    unsigned long long global[3];                                                    // Valori di tutta la matrice
+
+    // Una sola riduzione per passo, la somma non dipende dall'ordine dei processi
+    MPI_Allreduce(local, global, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    // Registrazione: vengono salvati anche gli hash dei singoli rank per individuare chi diverge
+    if (VERIFY == 1) {
+        unsigned long long *hashes = rank == MASTER ? malloc(world_size * sizeof(unsigned long long)) : NULL;
+        MPI_Gather(&local_hash, 1, MPI_UNSIGNED_LONG_LONG, hashes, 1, MPI_UNSIGNED_LONG_LONG, MASTER, MPI_COMM_WORLD);
+
+        if (rank == MASTER) {
+            fprintf(trace->file, "%d %llu %llu %llu", step, global[0], global[1], global[2]);
+            for (int i = 0; i < world_size; i++)
+                fprintf(trace->file, " %llu", hashes[i]);
+            fprintf(trace->file, "\n");
+        }
+
+        free(hashes);
+        return;
+    }
+
+    // Confronto: viene segnalata solo la prima divergenza
+    if (trace->diverged_step != -1 || step > trace->steps)
+        return;
+
+    unsigned long long *expected = trace->expected + step * 3;
+    if (global[0] == expected[0] && global[1] == expected[1] && global[2] == expected[2])
+        return;
+
+    // Il primo rank (il più piccolo) con l'hash diverso da quello atteso
+    int my_rank = (trace->per_rank && local_hash != trace->expected_local[step]) ? rank : world_size;
+    int diverging_rank;
+    MPI_Allreduce(&my_rank, &diverging_rank, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    trace->diverged_step = step;
+
+    if (rank == MASTER) {
+        printf("\033[1;31mDIVERGENZA\033[0m! Passo %d", step);
+        if (diverging_rank < world_size)
+            printf(", rank %d", diverging_rank);
+        printf("\n- Hash: %llu (atteso %llu)\n", global[0], expected[0]);
+        printf("- Agenti insoddisfatti: %llu (attesi %llu)\n", global[1], expected[1]);
+        printf("- Agenti spostati: %llu (attesi %llu)\n", global[2], expected[2]);
+    }
+}
+/*** Fine funzione per registrare o confrontare lo stato di un passo ***/
+
+/*** Inizio funzione per controllare che ogni processo sposti quanto con l'assegnazione alla pari ***/
+int verify_moves(int rank, int world_size, int step, stepResult *result) {
+    int local[3] = {result->number_of_local_void_cells, result->unsatisfied_agents, result->moved_agents};    // Valori del processo
+    int all[world_size * 3];                     // Valori di tutti i processi
+    cellIndex unsatisfied[world_size];           // Agenti insoddisfatti di ogni processo
+    cellIndex shares[world_size];                // Celle vuote spettanti ad ogni processo con l'assegnazione alla pari
+    cellIndex displacements[world_size];
+    cellIndex number_of_total_void_cells = 0;
+    long long moved = 0, expected = 0, total_unsatisfied = 0;    // Agenti spostati, attesi e insoddisfatti in tutta la matrice
+    int ok = 1;
+
+    // Ogni processo sposta tanti agenti quante celle riceve (al massimo i suoi insoddisfatti), con qualunque modo di assegnare le celle
+    MPI_Allgather(local, 3, MPI_INT, all, 3, MPI_INT, MPI_COMM_WORLD);
+    for (int i = 0; i < world_size; i++) {
+        unsatisfied[i] = all[i * 3 + 1];
+        total_unsatisfied += unsatisfied[i];
+        number_of_total_void_cells += all[i * 3];
+    }
+    split_void_cells(number_of_total_void_cells, world_size, unsatisfied, shares, displacements);
+
+    for (int i = 0; i < world_size; i++) {
+        cellIndex expected_moves = shares[i] < unsatisfied[i] ? shares[i] : unsatisfied[i];
+        ok &= all[i * 3 + 2] == expected_moves;
+        moved += all[i * 3 + 2];
+        expected += expected_moves;
+    }
+
+    if (!ok && rank == MASTER)
+        printf("\033[1;31mDIVERGENZA\033[0m! Passo %d: %lld agenti spostati su %lld insoddisfatti e %lld celle vuote (l'assegnazione alla pari ne sposta %lld)\n",
+               step, moved, total_unsatisfied, (long long)number_of_total_void_cells, expected);
+
+    return ok;
+}
+/*** Fine funzione per controllare che ogni processo sposti quanto con l'assegnazione alla pari ***/
+
+/*** Inizio funzione per chiudere la verifica ***/
+void verify_finish(int rank, verifyTrace *trace) {
+    if (rank == MASTER) {
+        if (VERIFY == 1) {
+            fclose(trace->file);
+            printf("\nTraccia registrata in %s\n", VERIFY_TRACE);
+        } else if (trace->diverged_step == -1) {
+            printf("\nVerifica: nessuna divergenza in %d passi\n", trace->steps);
+        }
+    }
+
+    free(trace->expected);
+    free(trace->expected_local);
+}
+/*** Fine funzione per chiudere la verifica ***/
+
+/*** Inizio funzione per aprire il file (o il socket) delle osservabili ***/
+FILE *metrics_init(int rank) {
+    FILE *stream = NULL;
+
+    // Solo il MASTER scrive le osservabili
+    if (rank != MASTER)
+        return NULL;
+
+    if (METRICS == 3) {
+        // Socket UNIX locale, ad esempio aperto da uno strumento di monitoraggio con: nc -lU metrics.sock
+        struct sockaddr_un address;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        // Se il lettore si chiude la scrittura deve fallire con un errore invece di terminare il processo
+        signal(SIGPIPE, SIG_IGN);
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, METRICS_OUTPUT, sizeof(address.sun_path) - 1);
+
+        if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            stream = fdopen(fd, "w");
+        else if (fd != -1)
+            close(fd);
+    } else
+        stream = fopen(METRICS_OUTPUT, "w");
+
+    // Il monitoraggio non è indispensabile: se l'uscita non è disponibile la simulazione continua senza osservabili
+    if (stream == NULL) {
+        printf("\033[1;31mATTENZIONE\033[0m! Impossibile aprire %s, le osservabili non verranno scritte.\n", METRICS_OUTPUT);
+        return NULL;
+    }
+
+    if (METRICS == 1)
+        fprintf(stream, "step,unsatisfied,moved,vacancies,similar_o,similar_x,time\n");
+
+    return stream;
+}
+/*** Fine funzione per aprire il file (o il socket) delle osservabili ***/
+
+/*** Inizio funzione per ridurre e scrivere le osservabili di un passo ***/
+void metrics_step(int rank, int step, long long *observables, double elapsed, FILE **stream) {
+    long long total[5];    // Agenti insoddisfatti, agenti spostati, celle vuote, vicini simili degli agenti 'O' e degli agenti 'X'
+    int written;           // Caratteri scritti (negativo in caso di errore)
+
+    // Una sola riduzione per passo, i dati sono O(1) indipendentemente dalla grandezza della matrice
+    MPI_Reduce(observables, total, 5, MPI_LONG_LONG, MPI_SUM, MASTER, MPI_COMM_WORLD);
+
+    if (rank != MASTER || *stream == NULL)
+        return;
+
+    if (METRICS == 1)
+        written = fprintf(*stream, "%d,%lld,%lld,%lld,%lld,%lld,%f\n", step, total[0], total[1], total[2], total[3], total[4], elapsed);
+    else
+        written = fprintf(*stream, "{\"step\":%d,\"unsatisfied\":%lld,\"moved\":%lld,\"vacancies\":%lld,\"similar_o\":%lld,\"similar_x\":%lld,\"time\":%f}\n", step, total[0], total[1], total[2], total[3], total[4], elapsed);
+
+    // Ogni passo è subito visibile a chi legge; al primo errore (ad esempio il lettore del socket si è chiuso) l'uscita viene abbandonata
+    if (written < 0 || fflush(*stream) != 0) {
+        printf("\033[1;31mATTENZIONE\033[0m! Impossibile scrivere su %s, le osservabili non verranno più scritte.\n", METRICS_OUTPUT);
+        fclose(*stream);
+        *stream = NULL;
+    }
+}
+/*** Fine funzione per ridurre e scrivere le osservabili di un passo ***/
+
 /*** Inizio funzione per visualizzare la matrice ***/
 void print_matrix(int rows_size, int column_size, char *matrix) {
-    int i;
+    cellIndex i;
     if (rows_size <= 0 || column_size <= 0 || matrix == NULL) {
         printf("\033[1;31mERROR\033[0m! Invalid input.\n");
         MPI_Abort(MPI_COMM_WORLD, 0);
         return;
     }
 
-    for (i = 0; i < rows_size * column_size; i++) {
+    for (i = 0; i < (cellIndex)rows_size * column_size; i++) {
         if (*(matrix + i) == AGENT_X) {
             printf(BLUE("%c") " ", *(matrix + i));
         } else if (*(matrix + i) == AGENT_O) {
@@ -757,7 +2360,7 @@ void print_matrix(int rows_size, int column_size, char *matrix) {
 /*** Fine funzione per visualizzare la matrice ***/
 
 /*** Inizio funzione per terminare in caso di errori ***/
-void err_finish(int *sendcounts, int *displacements, int *rows_per_process) {
+void err_finish(cellIndex *sendcounts, cellIndex *displacements, int *rows_per_process) {
     free(sendcounts);
     free(displacements);
     free(rows_per_process);
@@ -871,4 +2474,87 @@ void test_init_matrix(char *matrix, int O_pct, int X_pct) {
     matrix[9 * COLUMNS + 8] = AGENT_O;
     matrix[9 * COLUMNS + 9] = AGENT_X;
 }
-/*** Fine funzione di demo con matroce statica ***/
\ No newline at end of file
+/*** Fine funzione di demo con matroce statica ***/
+
+/*** Inizio funzione per leggere le righe del processo dal raster ***/
+int read_raster(int rank, int first_row, int number_of_rows, char *sub_matrix) {
+    MPI_File file;
+    MPI_Datatype raster_row_type;                       // Una riga del raster (le righe occupano sempre byte interi)
+    MPI_Status status;
+    MPI_Offset file_size;                               // Byte del file (intestazione e tutte le righe)
+    unsigned char header[RASTER_HEADER_SIZE];
+    unsigned int fields[3] = {0, 0, 0};                 // Righe, colonne e bit per cella
+    size_t row_bytes = 0;                               // Byte di una riga del raster
+    int count;                                          // Elementi letti davvero
+    int ok[2] = {1, 1};                                 // Righe lette per intero (1: sì, 0: no) e celle valide (1: sì, 0: no)
+
+    if (MPI_File_open(MPI_COMM_WORLD, RASTER_INPUT, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        if (rank == MASTER)
+            printf("\033[1;31mERRORE\033[0m! Impossibile aprire il raster %s.\n\n", RASTER_INPUT);
+        return 0;
+    }
+
+    // Ogni processo legge l'intestazione (pochi byte), così nessuno deve aspettare il master
+    int valid = MPI_File_get_size(file, &file_size) == MPI_SUCCESS;
+    if (MPI_File_read_at_all(file, 0, header, RASTER_HEADER_SIZE, MPI_BYTE, &status) != MPI_SUCCESS || MPI_Get_count(&status, MPI_BYTE, &count) != MPI_SUCCESS || count != RASTER_HEADER_SIZE)
+        valid = 0;
+
+    if (valid) {
+        for (int i = 0; i < 3; i++)
+            fields[i] = header[4 + 4 * i] | header[5 + 4 * i] << 8 | header[6 + 4 * i] << 16 | (unsigned int)header[7 + 4 * i] << 24;
+        row_bytes = ((size_t)COLUMNS * fields[2] + 7) / 8;
+
+        // Il file deve contenere esattamente tutte le righe, così una lettura corta non può passare inosservata
+        valid = memcmp(header, RASTER_MAGIC, 4) == 0 && fields[0] == ROWS && fields[1] == COLUMNS && (fields[2] == 1 || fields[2] == 2) &&
+                file_size == RASTER_HEADER_SIZE + (MPI_Offset)ROWS * (MPI_Offset)row_bytes;
+    }
+
+    // Tutti i processi devono prendere la stessa decisione prima della lettura collettiva
+    MPI_Allreduce(MPI_IN_PLACE, &valid, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!valid) {
+        if (rank == MASTER)
+            printf("\033[1;31mERRORE\033[0m! Il raster %s non è valido: servono l'intestazione di %d * %d celle da 1 o 2 bit e tutte le righe.\n\n", RASTER_INPUT, ROWS, COLUMNS);
+        MPI_File_close(&file);
+        return 0;
+    }
+
+    int bits = fields[2];
+    unsigned char *rows = malloc(number_of_rows * row_bytes);
+
+    // Lettura collettiva delle sole righe del processo, contate in righe per non superare il limite degli int
+    MPI_Type_contiguous(row_bytes, MPI_BYTE, &raster_row_type);
+    MPI_Type_commit(&raster_row_type);
+    if (MPI_File_read_at_all(file, RASTER_HEADER_SIZE + (MPI_Offset)first_row * row_bytes, rows, number_of_rows, raster_row_type, &status) != MPI_SUCCESS ||
+        MPI_Get_count(&status, raster_row_type, &count) != MPI_SUCCESS || count != number_of_rows)
+        ok[0] = 0;
+    MPI_Type_free(&raster_row_type);
+    MPI_File_close(&file);
+
+    // Decodifica direttamente nella sottomatrice (il primo campo di ogni byte è nei bit più alti)
+    for (int i = 0; i < number_of_rows && ok[0]; i++) {
+        unsigned char *row = rows + i * row_bytes;
+        char *cells = sub_matrix + (size_t)i * COLUMNS;
+
+        for (int j = 0; j < COLUMNS; j++) {
+            if (bits == 1)    // 0: vuota, 1: occupata da un agente 'O' o 'X' estratto dall'hash dell'indice globale con il rapporto O_PERCENTAGE : X_PERCENTAGE
+                cells[j] = (row[j >> 3] >> (7 - (j & 7)) & 1) ? (splitmix64((cellIndex)(first_row + i) * COLUMNS + j) % (O_PERCENTAGE + X_PERCENTAGE) < O_PERCENTAGE ? AGENT_O : AGENT_X) : EMPTY;
+            else {
+                int code = row[j >> 2] >> (6 - 2 * (j & 3)) & 3;                         // 00: vuota, 01: 'O', 10: 'X'
+                if (code == 3)
+                    ok[1] = 0;
+                cells[j] = code == 1 ? AGENT_O : code == 2 ? AGENT_X : EMPTY;
+            }
+        }
+    }
+    free(rows);
+
+    // Una lettura incompleta o un codice non valido in un qualsiasi processo ferma tutti
+    MPI_Allreduce(MPI_IN_PLACE, ok, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!ok[0] && rank == MASTER)
+        printf("\033[1;31mERRORE\033[0m! Impossibile leggere le righe del raster %s.\n\n", RASTER_INPUT);
+    else if (!ok[1] && rank == MASTER)
+        printf("\033[1;31mERRORE\033[0m! Il raster %s contiene celle con codice 11.\n\n", RASTER_INPUT);
+
+    return ok[0] && ok[1];
+}
+/*** Fine funzione per leggere le righe del processo dal raster ***/